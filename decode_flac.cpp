@@ -3,13 +3,16 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <tuple>
 #include <vector>
 #include <experimental/optional>
 
+#include "flacutil/arena.hpp"
 #include "flacutil/buffer.hpp"
 #include "flacutil/flac_decode.hpp"
 #include "flacutil/flac_struct.hpp"
+#include "flacutil/metrics.hpp"
 
 #include "utility.hpp"
 
@@ -55,6 +58,7 @@ sound_data decode_flacfile( char const *filename )
     std::uint64_t sample = 0;
     while( true )
     {
+        arena::scope frame_scope;
         auto frame = FLAC::ReadFrame( bs, *si );
         for( std::uint8_t ch = 0; ch < frame.header.channels; ++ch )
             FLAC::DecodeSubframe( &sound.wave[ ch ][ sample ], frame.subframes[ ch ], frame.header.blocksize );
@@ -101,12 +105,31 @@ sound_data decode_flacfile( char const *filename )
 int main( int argc, char **argv )
 try
 {
-    if( argc <= 2 )
+    // --metrics=FILE: JSON, or the Prometheus text format if FILE ends with .prom
+    std::string metrics_file;
+    std::vector< char const * > filenames;
+    for( int i = 1; i < argc; ++i )
+    {
+        std::string const arg = argv[ i ];
+        if( arg.compare( 0, 10, "--metrics=" ) == 0 )
+            metrics_file = arg.substr( 10 );
+        else
+            filenames.push_back( argv[ i ] );
+    }
+    if( filenames.size() < 2 )
         fatal( "No filename" );
-    sound_data sound = decode_flacfile( argv[ 1 ] );
+    std::unique_ptr< metrics::reporter > report;
+    if( !metrics_file.empty() )
+    {
+        metrics::enable();
+        report = std::make_unique< metrics::reporter >( metrics_file, metrics::format_for( metrics_file ), 0 );
+    }
+    sound_data sound = decode_flacfile( filenames[ 0 ] );
+    if( report )
+        report->finish();
     
     std::uint16_t i2; std::uint32_t i4;
-    std::ofstream ofs( argv[ 2 ] );
+    std::ofstream ofs( filenames[ 1 ] );
                                                                 ofs << "RIFF";
     i4 = sound.wave.size() * sound.bps / 8 * sound.length;      ofs.write( (char*)&i4, 4);
                                                                 ofs << "WAVE";
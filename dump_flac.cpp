@@ -7,6 +7,7 @@
 #include <utility>
 #include <experimental/optional>
 
+#include "flacutil/arena.hpp"
 #include "flacutil/buffer.hpp"
 #include "flacutil/flac_struct.hpp"
 
@@ -24,23 +25,29 @@ void dump_flacfile( char const *filename )
         fatal( filename, " is not FLAC file." );
     
     std::experimental::optional< FLAC::MetaData::StreamInfo > si;
+    std::experimental::optional< FLAC::MetaData::SeekTable > st;
     while( true )
     {
         auto md = FLAC::ReadMetadata( bs );
         if( md.type == FLAC::MetaData::Type::STREAMINFO )
             si = md.data.data< FLAC::MetaData::StreamInfo >();
+        else if( md.type == FLAC::MetaData::Type::SEEKTABLE )
+            st = md.data.data< FLAC::MetaData::SeekTable >();
         if( md.is_last )
             break;
     }
     if( !si )
         fatal( filename, ": No StreamInfo." );
     FLAC::PrintStreamInfo( *si );
+    if( st )
+        FLAC::PrintSeekTable( *st );
     
     std::size_t frame_num = 0;
     try
     {
         while( true )
         {
+            arena::scope frame_scope;
             auto frame = FLAC::ReadFrame( bs, *si );
             std::cout << "-----------------------------------" << std::endl;
             FLAC::PrintFrame( frame );
@@ -18,259 +18,506 @@
 #include <string>
 #include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "flacutil/buffer.hpp"
 #include "flacutil/flac_encode.hpp"
+#include "flacutil/flac_encoder.hpp"
 #include "flacutil/flac_struct.hpp"
 #include "flacutil/file.hpp"
+#include "flacutil/metrics.hpp"
+#include "flacutil/thread_pool.hpp"
 
 #include "utility.hpp"
 
-constexpr std::uint16_t prog_blocksize = 8192;
-
+struct encode_option
+{
+    FLAC::EncoderParameters encoder;
+    bool                    preallocate      = false; // reserve disk space for the output up front
+    std::string             metrics;                  // the file the metrics are written to, none if empty
+    unsigned int            metrics_interval = 10;    // seconds between the metrics reports, 0: only at the end
+};
 static
-std::tuple< FLAC::Subframe::Subframe, std::uint64_t > EncodeSubframe( std::int64_t const *first_sample, std::uint8_t const bps, std::uint16_t const blocksize )
+unsigned long parse_number( std::string const &arg, std::string const &value, unsigned long const min, unsigned long const max )
 {
-    FLAC::Subframe::Subframe sf;
-    sf.header.wasted_bits = 0;
-    std::uint64_t best_bits = std::numeric_limits< decltype( best_bits ) >::max();
-    if( [&]{
-        for( auto sample = first_sample, last = sample + blocksize; sample < last; ++sample )
-            if( *sample != *first_sample )
-                return false;
-        return true;
-    }() )
+    std::size_t idx = 0;
+    unsigned long v = 0;
+    try
     {
-        auto con = FLAC::EncodeConstant( first_sample, bps, blocksize );
-        sf.header.type = FLAC::Subframe::Type::CONSTANT;
-        sf.data = std::get< 0 >( con );
-        best_bits = std::get< 1 >( con );
+        v = std::stoul( value, &idx );
     }
-    else
+    catch( ... )
     {
-        auto ver = FLAC::EncodeVerbatim( first_sample, bps, blocksize );
-        if( std::get< 1 >( ver ) < best_bits )
+        idx = std::string::npos;
+    }
+    if( idx != value.size() || v < min || v > max )
+        fatal( arg, ": must be a number in [", min, ", ", max, "]" );
+    return v;
+}
+// SPEC[;SPEC...], SPEC: rectangle, bartlett, hann, welch, tukey(P) or partial_tukey(N[/P])
+// partial_tukey(N) is N windows, each a tukey window over one N-th of the block
+static
+std::vector< FLAC::Apodization > parse_apodization( std::string const &arg, std::string const &value )
+{
+    auto const parse_real = [ & ]( std::string const &s, double const min, double const max ) {
+        std::size_t idx = 0;
+        double v = 0.0;
+        try
         {
-            sf.header.type = FLAC::Subframe::Type::VERBATIM;
-            sf.data = std::move( std::get< 0 >( ver ) );
-            best_bits = std::get< 1 >( ver );
+            v = std::stod( s, &idx );
         }
-        for( std::uint8_t order = 0; order <= 4; ++order )
+        catch( ... )
         {
-            auto fixed = FLAC::EncodeFixed( first_sample, bps, order, blocksize );
-            if( std::get< 1 >( fixed ) < best_bits )
+            idx = std::string::npos;
+        }
+        if( idx != s.size() || !(min <= v && v <= max) )
+            fatal( arg, ": ", s, " must be a number in [", min, ", ", max, "]" );
+        return v;
+    };
+    std::vector< FLAC::Apodization > apodizations;
+    std::size_t pos = 0;
+    while( pos <= value.size() )
+    {
+        std::size_t const next = std::min( value.find( ';', pos ), value.size() );
+        std::string const spec = value.substr( pos, next - pos );
+        pos = next + 1;
+        auto const paren = spec.find( '(' );
+        std::string const name = spec.substr( 0, paren );
+        std::string parameter;
+        if( paren != std::string::npos )
+        {
+            if( spec.back() != ')' )
+                fatal( arg, ": ", spec, ": missing ')'" );
+            parameter = spec.substr( paren + 1, spec.size() - paren - 2 );
+        }
+        FLAC::Apodization a = { FLAC::Window::RECTANGLE, 0.0, 0.0, 1.0 };
+        if( name == "rectangle" )
+            a.type = FLAC::Window::RECTANGLE;
+        else if( name == "bartlett" )
+            a.type = FLAC::Window::BARTLETT;
+        else if( name == "hann" )
+            a.type = FLAC::Window::HANN;
+        else if( name == "welch" )
+            a.type = FLAC::Window::WELCH;
+        else if( name == "tukey" )
+        {
+            a.type = FLAC::Window::TUKEY;
+            a.p = paren == std::string::npos ? 0.5 : parse_real( parameter, 0.0, 1.0 );
+        }
+        else if( name == "partial_tukey" )
+        {
+            auto const slash = parameter.find( '/' );
+            unsigned long const n = parse_number( arg, parameter.substr( 0, slash ), 1, 16 );
+            a.type = FLAC::Window::TUKEY;
+            a.p = slash == std::string::npos ? 0.5 : parse_real( parameter.substr( slash + 1 ), 0.0, 1.0 );
+            for( unsigned long i = 0; i < n; ++i )
             {
-                sf.header.type = FLAC::Subframe::Type::FIXED;
-                sf.data = std::move( std::get< 0 >( fixed ) );
-                best_bits = std::get< 1 >( fixed );
+                a.start = static_cast< double >( i ) / n;
+                a.end = static_cast< double >( i + 1 ) / n;
+                apodizations.push_back( a );
             }
+            continue;
         }
-        // auto lpc = FLAC::EncodeLPC( first_sample, bps, FLAC::MAX_LPC_ORDER, blocksize );
-        // if( std::get< 1 >( lpc ) < best_bits )
-        // {
-            // sf.header.type = FLAC::Subframe::Type::LPC;
-            // sf.data = std::move( std::get< 0 >( lpc ) );
-            // best_bits = std::get< 1 >( lpc );
-        // }
+        else
+            fatal( arg, ": ", spec, ": unknown window" );
+        if( paren != std::string::npos && a.type != FLAC::Window::TUKEY )
+            fatal( arg, ": ", spec, ": the window takes no parameter" );
+        apodizations.push_back( a );
     }
-    return std::make_tuple( std::move( sf ), best_bits );
+    return apodizations;
 }
-class progress{
-private:
-    std::uint64_t const          maxvalue;
-    std::condition_variable      cond;
-    std::atomic< std::uint64_t > value;
-    std::mutex                   mutex;
-    
-public:
-    progress( std::uint64_t const maxvalue )
-        : maxvalue( maxvalue )
-        , value( 0 )
+constexpr int MAX_PRESET_LEVEL     = 8;
+constexpr int DEFAULT_PRESET_LEVEL = 5;
+// 0 is the fastest and 8 compresses best
+static
+encode_option preset_option( unsigned int const level )
+{
+    struct preset
     {
+        std::uint16_t    blocksize;
+        bool             variable_blocksize;
+        FLAC::StereoMode stereo;
+        std::uint8_t     max_lpc_order;
+        bool             search_qlp_coeff_precision;
+        std::uint8_t     max_partition_order;
+        char const      *apodization;
+    };
+    static constexpr preset presets[ MAX_PRESET_LEVEL + 1 ] = {
+        { 1152, false, FLAC::StereoMode::INDEPENDENT,  0, false, 3, "tukey(0.5)" },
+        { 1152, false, FLAC::StereoMode::ESTIMATE,     0, false, 3, "tukey(0.5)" },
+        { 1152, false, FLAC::StereoMode::EXHAUSTIVE,   0, false, 4, "tukey(0.5)" },
+        { 4096, false, FLAC::StereoMode::INDEPENDENT,  6, false, 4, "tukey(0.5)" },
+        { 4096, false, FLAC::StereoMode::ESTIMATE,     8, false, 4, "tukey(0.5)" },
+        { 4096, false, FLAC::StereoMode::ESTIMATE,     8, false, 5, "tukey(0.5)" },
+        { 4096, false, FLAC::StereoMode::EXHAUSTIVE,   8, false, 6, "tukey(0.5)" },
+        { 4096, false, FLAC::StereoMode::EXHAUSTIVE,   8, true,  6, "tukey(0.5);partial_tukey(2)" },
+        { 8192, true,  FLAC::StereoMode::EXHAUSTIVE,  12, true,  8, "tukey(0.5);partial_tukey(2)" },
+    };
+    preset const &p = presets[ level ];
+    encode_option opt;
+    opt.encoder.blocksize = p.blocksize;
+    opt.encoder.variable_blocksize = p.variable_blocksize;
+    opt.encoder.stereo = p.stereo;
+    opt.encoder.subframe.max_lpc_order = p.max_lpc_order;
+    opt.encoder.subframe.search_qlp_coeff_precision = p.search_qlp_coeff_precision;
+    opt.encoder.subframe.min_partition_order = 0;
+    opt.encoder.subframe.max_partition_order = p.max_partition_order;
+    opt.encoder.subframe.apodizations = parse_apodization( "preset", p.apodization );
+    return opt;
+}
+// Encode one file with the pool; the pool may be shared with other files encoded at the same time.
+// md5: the shared hasher of a batch, null for an own one
+// verbose: print the wave format and the progress
+static
+void EncodeFile( thread_pool::pool &pool, FLAC::MD5Pipeline *const md5, char const *const input_filename, char const *const output_filename, encode_option const &opt, bool const verbose )
+{
+    std::unique_ptr< file::wave_reader > reader;
+    try
+    {
+        reader = std::make_unique< file::wave_reader >( input_filename );
     }
-    void operator+=( std::uint64_t const v )
+    catch( ... )
     {
-        value += v;
-        cond.notify_all();
+        if( verbose )
+            std::cerr << "\"" << input_filename << "\": decode error" << std::endl;
+        throw;
     }
-    template< class Rep, class Period >
-    void wait_for( std::chrono::duration<Rep, Period> const &rel_time )
+    file::wave_format const wf = reader->get_format();
+    if( verbose )
+        file::print_wave_format( wf );
+    
+    std::unique_ptr< file::output_file > output;
+    try
     {
-        std::uint64_t const v = value.load();
-        if( v >= maxvalue )
-            return;
-        std::unique_lock< std::mutex > ul( mutex );
-        cond.wait_for( ul, rel_time, [ & ]{ return v != value.load(); } );
+        output = std::make_unique< file::output_file >( output_filename );
     }
-    std::uint64_t get() const noexcept
+    catch( ... )
     {
-        return value.load();
+        if( verbose )
+            std::cerr << "\"" << output_filename << "\": open error" << std::endl;
+        throw;
     }
-    bool is_end() const noexcept
+    // an output that was created is removed when the encoding fails; the input is opened before,
+    // so that a missing input leaves an existing output alone
+    try
     {
-        return value.load() >= maxvalue;
+        file::output_file &out = *output;
+        FLAC::Encoder encoder( { wf.sample_rate, static_cast< std::uint8_t >( wf.channels ), wf.bits_per_sample, wf.samples }, opt.encoder,
+            [ & ]( std::uint8_t const *const *data, std::size_t const *sizes, std::size_t const count ) { out.append( data, sizes, count ); }, &pool, md5 );
+        // written first as a placeholder of the same size, and rewritten when all frames are written
+        auto write_metadata = [ & ]
+        {
+            auto const mdbs = encoder.metadata();
+            if( out.get_size() == 0 )
+                out.append( mdbs.data(), mdbs.get_position() );
+            else
+                out.write_at( 0, mdbs.data(), mdbs.get_position() );
+        };
+        if( opt.preallocate )
+            out.preallocate( wf.samples * wf.channels * wf.bits_per_sample / 8 + 4096 + encoder.metadata().get_position() );
+        write_metadata();
+    
+        auto start_time = std::chrono::high_resolution_clock::now();
+        auto print_progress = [ & ]( std::uint64_t const encoded )
+        {
+            auto now_time = std::chrono::high_resolution_clock::now();
+            auto d = std::chrono::duration_cast< std::chrono::nanoseconds >( now_time - start_time );
+            std::printf( "\r%6.2f%% ", wf.samples ? static_cast< double >( encoded ) / wf.samples * 100 : 100.0 );
+            if( encoded )
+            {
+                auto time = static_cast< double >( d.count() ) / encoded * ( wf.samples - encoded );
+                auto sec = static_cast< std::uint64_t >( time * decltype( d )::period::num / decltype( d )::period::den );
+                if( sec < 1e5 && encoded < wf.samples )
+                    std::printf( "%5" PRIu64 "s", sec );
+                else
+                    std::printf( "      " );
+            }
+            std::cout << std::flush;
+        };
+        if( verbose )
+            encoder.set_progress( print_progress );
+        // the chunks the reader returns are handed to the encoder as they are, with the raw PCM for the MD5
+        std::uint64_t const chunk_samples = encoder.get_chunk_samples();
+        while( !reader->is_end() )
+        {
+            buffer::buffer pcm;
+            auto chunk = reader->read( chunk_samples, opt.encoder.md5 ? &pcm : nullptr );
+            encoder.push( std::move( chunk ), std::move( pcm ) );
+        }
+        encoder.finish();
+        if( verbose )
+        {
+            print_progress( wf.samples );
+            std::cout << "\n" << "done!" << std::endl;
+        }
+        // a pipe cannot be rewritten; the placeholder stays without MD5 and frame sizes
+        if( out.is_regular() )
+            write_metadata();
+        else if( verbose )
+            std::cerr << "\"" << output_filename << "\": not a regular file, STREAMINFO is left incomplete" << std::endl;
+        out.close();
     }
-    std::uint64_t get_maxvalue() const noexcept
+    catch( ... )
     {
-        return maxvalue;
+        bool const created = output->is_regular();
+        output.reset();
+        if( created )
+            std::remove( output_filename );
+        throw;
     }
+}
+// files encoded at the same time in batch mode; while the pool finishes the last chunks of
+// one file, the next one is read and its first chunks are queued
+constexpr unsigned int batch_files_inflight = 2;
+struct batch_job
+{
+    std::string input;
+    std::string output;
 };
-// return: bytestream, min_framesize, max_framesize
+// the input with its extension replaced by .flac, in output_dir if it is not empty
+static
+std::string BatchOutputFilename( std::string const &input, std::string const &output_dir )
+{
+    std::size_t const slash = input.rfind( '/' );
+    std::size_t const name = slash == std::string::npos ? 0 : slash + 1;
+    std::size_t const dot = input.rfind( '.' );
+    std::string const stem = input.substr( 0, dot != std::string::npos && dot > name ? dot : input.size() );
+    if( output_dir.empty() )
+        return stem + ".flac";
+    return output_dir + (output_dir.back() == '/' ? "" : "/") + stem.substr( name ) + ".flac";
+}
+// Encode every job with the shared pool and one hasher for all the files, so that no thread
+// is started per file; a file that fails is reported and removed, and the others are encoded
+// nevertheless.
+// return: the number of failed files
 static
-std::tuple< buffer::bytestream<>, std::uint32_t, std::uint32_t > EncodePartial( file::sound_data const &sd, std::uint64_t const first_sample_num, std::uint64_t const length, std::uint16_t const blocksize, progress &pro )
+std::size_t EncodeBatch( thread_pool::pool &pool, std::vector< batch_job > const &jobs, encode_option const &opt )
 {
-    std::uint64_t const last_sample = first_sample_num + length;
-    buffer::bytestream<> fbs;
-    std::uint32_t min_framesize = std::numeric_limits< decltype( min_framesize ) >::max();
-    std::uint32_t max_framesize = 0;
-    for( std::uint64_t sample = first_sample_num; sample < last_sample; sample += blocksize )
+    std::atomic< std::size_t > next( 0 );
+    std::atomic< std::size_t > done( 0 );
+    std::atomic< std::size_t > failed( 0 );
+    std::mutex                 print_mutex;
+    std::unique_ptr< FLAC::MD5Pipeline > md5;
+    if( opt.encoder.md5 )
+        md5 = std::make_unique< FLAC::MD5Pipeline >();
+    auto driver = [ & ]
     {
-        std::uint16_t const this_blocksize = sample + blocksize > last_sample ? last_sample - sample : blocksize;
-        FLAC::Frame::Frame f;
-        f.header.blocksize = this_blocksize;
-        f.header.sample_rate = sd.sample_rate;
-        f.header.channels = sd.wave.size();
-        f.header.channel_assignment = FLAC::Frame::ChannelAssignment::INDEPENDENT;
-        f.header.bits_per_sample = sd.bits_per_sample;
-        f.header.number_type = FLAC::Frame::NumberType::FRAME_NUMBER;
-        f.header.number.frame_number = sample / blocksize;
-        std::uint64_t bits = 0;
-        for( std::size_t ch = 0; ch < sd.wave.size(); ++ch )
-        {
-            std::uint64_t best_bits;
-            std::tie( f.subframes[ ch ], best_bits ) = EncodeSubframe( &sd.wave[ ch ][ sample ], sd.bits_per_sample, this_blocksize );
-            bits += best_bits;
-        }
-        if( sd.wave.size() == 2 )
+        for( std::size_t i; (i = next++) < jobs.size(); )
         {
-            auto mid = std::make_unique< std::int64_t[] >( this_blocksize );
-            auto side = std::make_unique< std::int64_t[] >( this_blocksize );
-            for( std::uint16_t i = 0; i < this_blocksize; ++i )
+            batch_job const &job = jobs[ i ];
+            try
             {
-                std::int64_t m, s, x;
-                m = s = sd.wave[ 0 ][ sample + i ];
-                x = sd.wave[ 1 ][ sample + i ];
-                m += x;
-                s -= x;
-                m >>= 1; // TODO: OK?
-                mid[ i ] = m;
-                side[ i ] = s;
+                EncodeFile( pool, md5.get(), job.input.c_str(), job.output.c_str(), opt, false );
+                std::lock_guard< std::mutex > lg( print_mutex );
+                std::cout << "[" << ++done << "/" << jobs.size() << "] " << job.input << " -> " << job.output << std::endl;
             }
-            auto mid_subframe = EncodeSubframe( mid.get(), sd.bits_per_sample, this_blocksize );
-            auto side_subframe = EncodeSubframe( side.get(), sd.bits_per_sample + 1, this_blocksize );
-            std::uint64_t const mid_side_bits = std::get< 1 >( mid_subframe ) + std::get< 1 >( side_subframe );
-            if( mid_side_bits < bits )
+            catch( std::exception &e )
             {
-                f.header.channel_assignment = FLAC::Frame::ChannelAssignment::MID_SIDE;
-                f.subframes[ 0 ] = std::move( std::get< 0 >( mid_subframe ) );
-                f.subframes[ 1 ] = std::move( std::get< 0 >( side_subframe ) );
-                bits = mid_side_bits;
+                ++failed;
+                std::lock_guard< std::mutex > lg( print_mutex );
+                std::cerr << "[" << ++done << "/" << jobs.size() << "] \"" << job.input << "\": " << e.what() << std::endl;
             }
         }
-        std::size_t const pos = fbs.get_position();
-        FLAC::WriteFrame( fbs, f );
-        std::uint32_t const framesize = fbs.get_position() - pos;
-        min_framesize = std::min( min_framesize, framesize );
-        max_framesize = std::max( max_framesize, framesize );
-        pro += this_blocksize;
-    }
-    return std::make_tuple( std::move( fbs ), min_framesize, max_framesize );
+    };
+    std::vector< std::thread > drivers;
+    for( unsigned int i = 1; i < batch_files_inflight && i < jobs.size(); ++i )
+        drivers.emplace_back( driver );
+    driver();
+    for( auto &&t : drivers )
+        t.join();
+    return failed;
 }
 
 int main( int argc, char **argv )
 try
 {
-    if( argc < 3 )
-        fatal( "no filename" );
-    file::sound_data sd;
-    try
+    // the preset is applied first, so that the other options override it
+    unsigned int level = DEFAULT_PRESET_LEVEL;
+    for( int i = 1; i < argc; ++i )
     {
-        sd = file::decode_wavefile( argv[ 1 ] );
+        std::string const arg = argv[ i ];
+        if( arg.size() == 2 && arg[ 0 ] == '-' && '0' <= arg[ 1 ] && arg[ 1 ] <= '0' + MAX_PRESET_LEVEL )
+            level = arg[ 1 ] - '0';
+        else if( arg.compare( 0, 8, "--level=" ) == 0 )
+            level = parse_number( arg, arg.substr( 8 ), 0, MAX_PRESET_LEVEL );
     }
-    catch( ... )
+    encode_option opt = preset_option( level );
+    std::vector< char const * > filenames;
+    bool        batch = false;
+    std::string file_list;  // batch inputs, one per line; "-": the standard input
+    std::string output_dir; // batch outputs, next to the inputs if empty
+    for( int i = 1; i < argc; ++i )
     {
-        std::cerr << "\"" << argv[ 1 ] << "\": decode error" << std::endl;
-        throw;
-    }
-    file::print_sound_data( sd );
-    
-    FLAC::MetaData::StreamInfo si;
-    si.min_blocksize = prog_blocksize;
-    si.max_blocksize = prog_blocksize;
-    si.min_framesize = std::numeric_limits< decltype( si.min_framesize ) >::max();
-    si.max_framesize = 0;
-    si.sample_rate = sd.sample_rate;
-    si.channels = sd.wave.size();
-    si.bits_per_sample = sd.bits_per_sample;
-    si.total_sample = sd.samples;
-    std::memset( si.md5sum, 0, sizeof( si.md5sum ) );
-    
-    progress pro( sd.samples );
-    unsigned int const num_cpu = std::thread::hardware_concurrency();
-    std::vector< std::future< std::tuple< buffer::bytestream<>, std::uint32_t, std::uint32_t > > > fuvec;
-    for( unsigned int i = 0; i < num_cpu; ++i )
-    {
-        std::promise< decltype( fuvec[ 0 ].get() ) > p;
-        fuvec.emplace_back( p.get_future() );
-        std::thread( [ &, i, p = std::move( p ) ]() mutable
+        std::string const arg = argv[ i ];
+        auto const eq = arg.find( '=' );
+        std::string const name = arg.substr( 0, eq );
+        std::string const value = eq == std::string::npos ? "" : arg.substr( eq + 1 );
+        if( arg.size() == 2 && arg[ 0 ] == '-' && '0' <= arg[ 1 ] && arg[ 1 ] <= '0' + MAX_PRESET_LEVEL )
+            ; // preset, already applied
+        else if( name == "--level" )
+            ; // preset, already applied
+        else if( name == "--blocksize" )
         {
-            try
-            {
-                std::uint64_t const def_sample = sd.samples / prog_blocksize / num_cpu * prog_blocksize;
-                auto enc = EncodePartial( sd, def_sample * i, i == num_cpu - 1 ? sd.samples - def_sample * i : def_sample, prog_blocksize, pro );
-                p.set_value( std::move( enc ) );
-            }
-            catch( ... )
+            opt.encoder.blocksize = parse_number( arg, value, FLAC::MIN_BLOCK_SIZE, FLAC::MAX_BLOCK_SIZE );
+            opt.encoder.variable_blocksize = false;
+        }
+        else if( name == "--variable-blocksize" )
+        {
+            // --variable-blocksize[=MIN:MAX]
+            opt.encoder.variable_blocksize = true;
+            opt.encoder.min_blocksize = 1024;
+            opt.encoder.blocksize = 16384;
+            if( eq != std::string::npos )
             {
-                p.set_exception( std::current_exception() );
+                auto const colon = value.find( ':' );
+                if( colon == std::string::npos )
+                    fatal( arg, ": must be MIN:MAX" );
+                opt.encoder.min_blocksize = parse_number( arg, value.substr( 0, colon ), FLAC::MIN_BLOCK_SIZE, FLAC::MAX_BLOCK_SIZE );
+                opt.encoder.blocksize = parse_number( arg, value.substr( colon + 1 ), opt.encoder.min_blocksize, FLAC::MAX_BLOCK_SIZE );
             }
-        }).detach();
+        }
+        else if( name == "--max-lpc-order" )
+            opt.encoder.subframe.max_lpc_order = parse_number( arg, value, 0, FLAC::MAX_LPC_ORDER );
+        else if( name == "--apodization" )
+            opt.encoder.subframe.apodizations = parse_apodization( arg, value );
+        else if( name == "--qlp-coeff-precision-search" )
+            opt.encoder.subframe.search_qlp_coeff_precision = true;
+        else if( name == "--partition-order" )
+        {
+            // --partition-order=MIN:MAX
+            auto const colon = value.find( ':' );
+            if( colon == std::string::npos )
+                fatal( arg, ": must be MIN:MAX" );
+            opt.encoder.subframe.min_partition_order = parse_number( arg, value.substr( 0, colon ), 0, 15 );
+            opt.encoder.subframe.max_partition_order = parse_number( arg, value.substr( colon + 1 ), opt.encoder.subframe.min_partition_order, 15 );
+        }
+        else if( name == "--no-mid-side" )
+            opt.encoder.stereo = FLAC::StereoMode::INDEPENDENT;
+        else if( name == "--stereo" )
+        {
+            if( value == "independent" )
+                opt.encoder.stereo = FLAC::StereoMode::INDEPENDENT;
+            else if( value == "estimate" )
+                opt.encoder.stereo = FLAC::StereoMode::ESTIMATE;
+            else if( value == "exhaustive" )
+                opt.encoder.stereo = FLAC::StereoMode::EXHAUSTIVE;
+            else
+                fatal( arg, ": invalid stereo mode" );
+        }
+        else if( name == "--seek-interval" )
+        {
+            // --seek-interval=N[s]: every N samples, or every N seconds
+            opt.encoder.seek_in_seconds = !value.empty() && value.back() == 's';
+            opt.encoder.seek_interval = parse_number( arg, opt.encoder.seek_in_seconds ? value.substr( 0, value.size() - 1 ) : value, 0, std::numeric_limits< unsigned long >::max() );
+        }
+        else if( name == "--no-seektable" )
+            opt.encoder.seek_interval = 0;
+        else if( name == "--no-md5" )
+            opt.encoder.md5 = false;
+        else if( name == "--preallocate" )
+            opt.preallocate = true;
+        else if( name == "--metrics" )
+        {
+            // --metrics=FILE: JSON, or the Prometheus text format if FILE ends with .prom
+            if( value.empty() )
+                fatal( arg, ": no file" );
+            opt.metrics = value;
+        }
+        else if( name == "--metrics-interval" )
+            opt.metrics_interval = parse_number( arg, value, 0, 86400 );
+        else if( name == "--batch" )
+            batch = true;
+        else if( name == "--file-list" )
+        {
+            if( value.empty() )
+                fatal( arg, ": no file" );
+            file_list = value;
+            batch = true;
+        }
+        else if( name == "--output-dir" )
+        {
+            if( value.empty() )
+                fatal( arg, ": no directory" );
+            output_dir = value;
+        }
+        else if( name == "--threads" )
+            opt.encoder.threads = parse_number( arg, value, 0, 1024 );
+        else if( arg.compare( 0, 2, "--" ) == 0 )
+            fatal( arg, ": unknown option" );
+        else
+            filenames.push_back( argv[ i ] );
     }
-    auto start_time = std::chrono::high_resolution_clock::now();
-    while( !pro.is_end() )
+    if( !batch && filenames.size() < 2 )
+        fatal( "no filename" );
+    // --batch: every filename is an input, and a directory stands for the .wav files in it
+    std::vector< batch_job > jobs;
+    if( batch )
     {
-        pro.wait_for( std::chrono::seconds( 1 ) );
-        auto now_time = std::chrono::high_resolution_clock::now();
-        auto d = std::chrono::duration_cast< std::chrono::nanoseconds >( now_time - start_time );
-        std::printf( "\r%6.2f%% ", static_cast< double >( pro.get() ) / pro.get_maxvalue() * 100 );
-        if( pro.get() )
+        std::vector< std::string > inputs;
+        auto const is_wave = []( std::string const &path ) {
+            std::string ext = path.size() >= 4 ? path.substr( path.size() - 4 ) : "";
+            std::transform( ext.begin(), ext.end(), ext.begin(), []( char const c ) { return 'A' <= c && c <= 'Z' ? c - 'A' + 'a' : c; } );
+            return ext == ".wav";
+        };
+        for( auto &&filename : filenames )
         {
-            auto time = static_cast< double >( d.count() ) / pro.get() * ( pro.get_maxvalue() - pro.get() );
-            auto sec = static_cast< std::uint64_t >( time * decltype( d )::period::num / decltype( d )::period::den );
-            if( sec < 1e5 && !pro.is_end() )
-                std::printf( "%5" PRIu64 "s", sec );
+            if( !is_directory( filename ) )
+                inputs.emplace_back( filename );
             else
-                std::printf( "      " );
+                for( auto &&path : list_directory( filename ) )
+                    if( is_wave( path ) )
+                        inputs.push_back( path );
+        }
+        if( !file_list.empty() )
+        {
+            std::ifstream ifs;
+            if( file_list != "-" )
+            {
+                ifs.open( file_list );
+                if( !ifs )
+                    fatal( file_list, ": open error" );
+            }
+            std::istream &is = file_list == "-" ? std::cin : ifs;
+            for( std::string line; std::getline( is, line ); )
+                if( !line.empty() )
+                    inputs.push_back( line );
+        }
+        if( inputs.empty() )
+            fatal( "no input file" );
+        std::unordered_map< std::string, std::string > outputs; // output -> input
+        outputs.reserve( inputs.size() );
+        for( auto &&input : inputs )
+        {
+            batch_job job = { input, BatchOutputFilename( input, output_dir ) };
+            if( job.output == job.input )
+                fatal( input, ": the output would overwrite the input" );
+            auto const inserted = outputs.emplace( job.output, input );
+            if( !inserted.second )
+                fatal( job.output, ": the output of both \"", inserted.first->second, "\" and \"", input, "\"" );
+            jobs.push_back( std::move( job ) );
         }
-        std::cout << std::flush;
     }
-    std::cout << "\n" << "done!" << std::endl;
-    std::vector< decltype( fuvec[ 0 ].get() ) > datavec;
-    for( auto &&fu : fuvec )
+    
+    std::unique_ptr< metrics::reporter > report;
+    if( !opt.metrics.empty() )
     {
-        auto encdata = fu.get();
-        si.min_framesize = std::min( std::get< 1 >( encdata ), si.min_framesize );
-        si.max_framesize = std::max( std::get< 2 >( encdata ), si.max_framesize );
-        datavec.emplace_back( std::move( encdata ) );
+        metrics::enable();
+        report = std::make_unique< metrics::reporter >( opt.metrics, metrics::format_for( opt.metrics ), opt.metrics_interval );
     }
-    FLAC::MetaData::Metadata md;
-    md.type = FLAC::MetaData::Type::STREAMINFO;
-    md.is_last = true;
-    md.length = FLAC::STREAMINFO_LENGTH;
-    md.data = std::move( si );
-    buffer::bytestream<> mdbs;
-    mdbs.put_bytes( FLAC::STREAM_SYNC_STRING, 4 );
-    FLAC::WriteMetadata( mdbs, md );
-    
-    std::ofstream ofs( argv[ 2 ] );
-    if( !ofs )
-        fatal( argv[ 2 ], ": open error" );
-    ofs.write( (char*)mdbs.data(), mdbs.get_position() );
-    for( auto &&encdata : datavec )
-        ofs.write( (char*)std::get< 0 >( encdata ).data(), std::get< 0 >( encdata ).get_position() );
+    // one pool for all the files, so that the threads are started once
+    thread_pool::pool pool( opt.encoder.threads );
+    std::size_t failed = 0;
+    if( batch )
+        failed = EncodeBatch( pool, jobs, opt );
+    else
+        EncodeFile( pool, nullptr, filenames[ 0 ], filenames[ 1 ], opt, true );
+    if( report )
+        report->finish();
+    return failed == 0 ? 0 : 1;
 }
 catch( std::exception &e )
 {
     std::cerr << e.what() << std::endl;
+    return 1;
 }
@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+
+#include "arena.hpp"
+
+namespace arena
+{
+
+// enough for the buffers of a stereo frame of 4096 samples
+constexpr std::size_t BLOCK_SIZE = 256 * 1024;
+constexpr std::size_t ALIGNMENT = alignof( std::max_align_t );
+
+arena::arena() noexcept
+    : current( 0 )
+    , used( 0 )
+{
+}
+void *arena::allocate( std::size_t bytes )
+{
+    bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if( current < blocks.size() && blocks[ current ].size - used >= bytes )
+    {
+        void *const p = blocks[ current ].data.get() + used;
+        used += bytes;
+        return p;
+    }
+    // the blocks after current are free; one that is too small is replaced
+    std::size_t const next = current < blocks.size() && used != 0 ? current + 1 : current;
+    if( next == blocks.size() )
+        blocks.push_back( block{ nullptr, 0 } );
+    if( blocks[ next ].size < bytes )
+    {
+        std::size_t const size = std::max( BLOCK_SIZE, bytes );
+        blocks[ next ].data = std::make_unique< unsigned char[] >( size );
+        blocks[ next ].size = size;
+    }
+    current = next;
+    used = bytes;
+    return blocks[ current ].data.get();
+}
+arena &arena::local() noexcept
+{
+    static thread_local arena a;
+    return a;
+}
+
+} // namespace arena
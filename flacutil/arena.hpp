@@ -0,0 +1,95 @@
+#ifndef FLACUTIL_ARENA_HPP
+#define FLACUTIL_ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace arena
+{
+
+// Per-thread bump allocator for the buffers of a frame.
+// Memory is never freed one by one; a scope rewinds the arena of its thread to where it
+// was when the scope was opened. Scopes live on the stack, so they close in the reverse
+// order on every thread, also when a thread runs pool tasks while it waits.
+class arena
+{
+private:
+    struct block
+    {
+        std::unique_ptr< unsigned char[] > data;
+        std::size_t                        size;
+    };
+    std::vector< block > blocks;
+    std::size_t          current; // the block allocations are taken from
+    std::size_t          used;    // bytes used in blocks[ current ]
+
+public:
+    struct mark
+    {
+        std::size_t block;
+        std::size_t used;
+    };
+
+    arena() noexcept;
+    arena( arena const & ) = delete;
+    arena &operator=( arena const & ) = delete;
+
+    // aligned for any scalar type; the memory is uninitialized
+    void *allocate( std::size_t bytes );
+    mark get_mark() const noexcept
+    {
+        return { current, used };
+    }
+    void rewind( mark const &m ) noexcept
+    {
+        current = m.block;
+        used = m.used;
+    }
+    // the arena of the calling thread
+    static arena &local() noexcept;
+};
+
+// Releases everything allocated from the arena of the thread after its construction.
+class scope
+{
+private:
+    arena      &a;
+    arena::mark m;
+
+public:
+    scope() noexcept
+        : a( arena::local() )
+        , m( a.get_mark() )
+    {
+    }
+    scope( scope const & ) = delete;
+    scope &operator=( scope const & ) = delete;
+    ~scope()
+    {
+        a.rewind( m );
+    }
+};
+
+// the memory belongs to the arena, so the pointer does not free it
+struct no_delete
+{
+    void operator()( void const * ) const noexcept
+    {
+    }
+};
+template< typename T >
+using array = std::unique_ptr< T[], no_delete >;
+
+// n uninitialized elements from the arena of the calling thread, valid until the enclosing scope closes
+template< typename T >
+array< T > make_array( std::size_t const n )
+{
+    static_assert( std::is_trivially_destructible< T >::value, "arena memory is not destructed" );
+    return array< T >( static_cast< T* >( arena::local().allocate( n * sizeof( T ) ) ) );
+}
+
+} // namespace arena
+
+#endif // FLACUTIL_ARENA_HPP
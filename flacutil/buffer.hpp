@@ -16,6 +16,11 @@ namespace buffer{
 namespace detail
 {
     constexpr std::size_t BITS_IN_BYTE = 8;
+    // the zigzag mapping of rice codes: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+    inline std::uint64_t int2uint( std::int64_t const num ) noexcept
+    {
+        return (static_cast< std::uint64_t >( num ) << 1) ^ static_cast< std::uint64_t >( num >> 63 );
+    }
 } // namespace detail
 
 class exception : public std::exception
@@ -59,14 +64,14 @@ public:
     {
         return size;
     }
+    // the bytes behind the old size are left uninitialized (and untouched)
     void reserve( std::size_t const rsize )
     {
         if( rsize > size )
         {
-            auto tmp = std::make_unique< std::uint8_t[] >( rsize );
+            std::unique_ptr< std::uint8_t[] > tmp( new std::uint8_t[ rsize ] );
             if( buff )
                 std::memcpy( tmp.get(), buff.get(), size );
-            std::memset( tmp.get() + size, 0, rsize - size );
             std::swap( buff, tmp );
             size = rsize;
         }
@@ -83,6 +88,10 @@ public:
     {
         return buff.get();
     }
+    std::uint8_t *get() noexcept
+    {
+        return buff.get();
+    }
     std::unique_ptr< std::uint8_t[] > move_data() && noexcept
     {
         return std::move( buff );
@@ -168,11 +177,21 @@ public:
     {
         return buffer::get();
     }
+    std::uint8_t *data() noexcept
+    {
+        return buffer::get();
+    }
+    std::size_t get_capacity( void ) const noexcept
+    {
+        return buffer::get_size();
+    }
     std::unique_ptr< std::uint8_t[] > move_data() && noexcept
     {
         return std::move( *this ).buffer::move_data();
     }
 };
+// Hashes the bytes read or written through it. The bytes are hashed as one range when the
+// hash is asked for (or the position is moved), not one by one.
 template< typename Hash, typename... Hashes >
 class bytestream< Hash, Hashes... >
 {
@@ -182,11 +201,19 @@ class bytestream< Hash, Hashes... >
 private:
     Hash                     hash;
     bytestream< Hashes... > &under;
+    std::size_t              hashed; // the bytes before hashed are in hash
     
     bytestream( bytestream< Hashes... > &under ) noexcept
         : hash()
         , under( under )
+        , hashed( under.get_position() )
+    {
+    }
+    void update_hash() noexcept
     {
+        std::size_t const pos = under.get_position();
+        hash.update( under.data() + hashed, pos - hashed );
+        hashed = pos;
     }
     
 public:
@@ -196,31 +223,26 @@ public:
     bytestream &operator=( bytestream && ) = default;
     std::uint8_t get_byte()
     {
-        std::uint8_t ret = under.get_byte();
-        hash.update( ret );
-        return ret;
+        return under.get_byte();
     }
     std::unique_ptr< std::uint8_t[] > get_bytes( std::size_t const size )
     {
-        auto buff = under.get_bytes( size );
-        for( std::size_t i = 0; i < size; ++i )
-            hash.update( buff[ i ] );
-        return std::move( buff );
+        return under.get_bytes( size );
     }
     void put_byte( std::uint8_t const data )
     {
         under.put_byte( data );
-        hash.update( data );
     }
     void put_bytes( std::uint8_t const *data, std::size_t const size )
     {
         under.put_bytes( data, size );
-        for( std::size_t i = 0; i < size; ++i )
-            hash.update( data[ i ] );
     }
+    // the bytes skipped or rewound over are not hashed
     void set_position( std::size_t const spos ) noexcept
     {
+        update_hash();
         under.set_position( spos );
+        hashed = spos;
     }
     std::size_t get_position( void ) const noexcept
     {
@@ -243,8 +265,9 @@ public:
     {
         return under.data();
     }
-    Hash const &get_hash() const noexcept
+    Hash const &get_hash() noexcept
     {
+        update_hash();
         return hash;
     }
 };
@@ -346,6 +369,22 @@ public:
             bitpos = rest;
         }
     }
+    void put_zeros( std::uint64_t num )
+    {
+        for( ; num >= 64; num -= 64 )
+            put( 0, 64 );
+        if( num != 0 )
+            put( 0, num );
+    }
+    void put_rice_block( std::int64_t const *nums, std::size_t const size, std::uint8_t const param )
+    {
+        for( std::size_t i = 0; i < size; ++i )
+        {
+            std::uint64_t const num = detail::int2uint( nums[ i ] );
+            put_zeros( num >> param );
+            put( (num & ((static_cast< std::uint64_t >( 1 ) << param) - 1)) | (static_cast< std::uint64_t >( 1 ) << param), param + 1 );
+        }
+    }
     bool is_available( std::uint8_t const bit ) const noexcept
     {
         if( bitpos )
@@ -385,6 +424,142 @@ auto make_bitstream( ByteStream &bs ) noexcept
     return bitstream< ByteStream >( bs );
 }
 
+// Writer for bytestream<> that collects the bits in a 64-bit word and stores whole words.
+// The written bytes reach the bytestream (and its position) on flush(); the bits of an
+// incomplete byte stay pending until it is completed.
+class bitwriter
+{
+private:
+    bytestream<> &bs;
+    std::uint8_t *out;
+    std::size_t   pos;      // bytes stored in out
+    std::size_t   capacity;
+    std::uint64_t acc   = 0; // the pending bits are the low count bits
+    unsigned int  count = 0; // always < 64
+
+    void grow( std::size_t const size )
+    {
+        bs.reserve( size );
+        out = bs.data();
+        capacity = bs.get_capacity();
+    }
+    // big endian, 8 bytes at pos; only the bytes the caller counts are valid
+    void store( std::uint64_t const word )
+    {
+        if( pos + 8 > capacity )
+            grow( pos + 8 );
+        for( unsigned int i = 0; i < 8; ++i )
+            out[ pos + i ] = static_cast< std::uint8_t >( word >> (56 - 8 * i) );
+    }
+
+public:
+    bitwriter( bytestream<> &bs ) noexcept
+        : bs( bs )
+        , out( bs.data() )
+        , pos( bs.get_position() )
+        , capacity( bs.get_capacity() )
+    {
+    }
+    bitwriter( bitwriter const & ) = delete;
+    bitwriter &operator=( bitwriter const & ) = delete;
+    void put( std::uint64_t num, std::uint8_t const bit )
+    {
+        assert( 1 <= bit && bit <= 64 );
+        if( bit != 64 )
+            num &= (static_cast< std::uint64_t >( 1 ) << bit) - 1;
+        unsigned int const free = 64 - count;
+        if( bit < free )
+        {
+            acc = (acc << bit) | num;
+            count += bit;
+            return;
+        }
+        unsigned int const rest = bit - free;
+        store( (free == 64 ? 0 : acc << free) | (num >> rest) );
+        pos += 8;
+        acc = num;
+        count = rest;
+    }
+    void put_zeros( std::uint64_t num )
+    {
+        unsigned int const free = 64 - count;
+        if( num < free )
+        {
+            acc <<= num;
+            count += num;
+            return;
+        }
+        store( free == 64 ? 0 : acc << free );
+        pos += 8;
+        num -= free;
+        // whole words of zeros at once
+        std::size_t const zero_bytes = num / 64 * 8;
+        reserve( pos + zero_bytes );
+        std::memset( out + pos, 0, zero_bytes );
+        pos += zero_bytes;
+        acc = 0;
+        count = num % 64;
+    }
+    // Rice codes of the zigzag mapped nums. The accumulator is kept in registers while the
+    // codewords fit into it, and long unary parts are written as zero fills.
+    void put_rice_block( std::int64_t const *nums, std::size_t const size, std::uint8_t const param )
+    {
+        assert( param < 63 );
+        std::uint64_t const stop_bit = static_cast< std::uint64_t >( 1 ) << param;
+        std::uint64_t a = acc;
+        unsigned int c = count;
+        for( std::size_t i = 0; i < size; ++i )
+        {
+            std::uint64_t const num = detail::int2uint( nums[ i ] );
+            std::uint64_t const q = num >> param;
+            std::uint64_t const low = (num & (stop_bit - 1)) | stop_bit;
+            if( q + param + 1 < 64 - c )
+            {
+                a = (a << (q + param + 1)) | low;
+                c += q + param + 1;
+                continue;
+            }
+            acc = a;
+            count = c;
+            put_zeros( q );
+            put( low, param + 1 );
+            a = acc;
+            c = count;
+        }
+        acc = a;
+        count = c;
+    }
+    // store the complete bytes and move the position of the bytestream behind them
+    void flush()
+    {
+        if( count >= detail::BITS_IN_BYTE )
+        {
+            store( acc << (64 - count) );
+            pos += count / detail::BITS_IN_BYTE;
+            count %= detail::BITS_IN_BYTE;
+        }
+        bs.set_position( pos );
+    }
+    std::tuple< std::size_t, unsigned int > get_position( void ) const noexcept
+    {
+        return std::make_tuple( pos + count / detail::BITS_IN_BYTE, count % detail::BITS_IN_BYTE );
+    }
+    // room for size bytes in the bytestream, so that no word on the way needs to grow it
+    void reserve( std::size_t const size )
+    {
+        if( size > capacity )
+            grow( size );
+    }
+    bytestream<> &get_bytestream( void ) noexcept
+    {
+        return bs;
+    }
+    bitwriter &get_bitstream( void ) noexcept
+    {
+        return *this;
+    }
+};
+
 template< typename BitStream >
 class useful_bitstream 
 {
@@ -402,9 +577,7 @@ private:
     static
     std::uint64_t int2uint( std::int64_t const num ) noexcept
     {
-        if( num >= 0 )
-            return static_cast< std::uint64_t >( num ) << 1;
-        return (static_cast< std::uint64_t >( -num ) << 1) - 1;
+        return detail::int2uint( num );
     }
 
 public:
@@ -462,10 +635,9 @@ public:
     {
         return uint2int( get_unary() );
     }
-    void put_unary( std::uint64_t num )
+    void put_unary( std::uint64_t const num )
     {
-        while( num-- )
-            put( 0, 1 );
+        bs.put_zeros( num );
         put( 1, 1 );
     }
     void put_unary_int( std::int64_t const num )
@@ -499,6 +671,12 @@ public:
     {
         put_rice( int2uint( num ), param );
     }
+    // put_rice_int for every element of nums
+    void put_rice_block( std::int64_t const *nums, std::size_t const size, std::uint8_t const param )
+    {
+        assert( 0 <= param && param < 63 );
+        bs.put_rice_block( nums, size, param );
+    }
     std::unique_ptr< std::uint8_t[] > get_bytes( std::size_t const size )
     {
         auto buff = std::make_unique< std::uint8_t[] >( size );
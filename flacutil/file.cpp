@@ -1,81 +1,218 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "buffer.hpp"
 #include "file.hpp"
 #include "flac_struct.hpp"
 
 namespace file{
 
-void print_sound_data( sound_data const &sd )
+void print_wave_format( wave_format const &wf )
 {
     std::cout << "sound_data" << std::endl;
     std::cout << std::dec;
-    std::cout << "  bps         = " << (int)sd.bits_per_sample << std::endl;
-    std::cout << "  length      = " <<      sd.samples         << std::endl;
-    std::cout << "  sample_rate = " <<      sd.sample_rate     << std::endl;
-    std::cout << "  channels    = " <<      sd.wave.size()     << std::endl;
+    std::cout << "  bps         = " << (int)wf.bits_per_sample << std::endl;
+    std::cout << "  length      = " <<      wf.samples         << std::endl;
+    std::cout << "  sample_rate = " <<      wf.sample_rate     << std::endl;
+    std::cout << "  channels    = " <<      wf.channels        << std::endl;
 }
-
-static
-std::tuple< std::unique_ptr< std::uint8_t[] >, std::size_t > read_file( char const *filename )
+void print_sound_data( sound_data const &sd )
 {
-    std::ifstream file( filename, std::ios::binary | std::ios::ate );
-    if( !file )
-        throw FLAC::exception( "read_file: open file error" );
-    std::streamsize size = file.tellg();
-    file.seekg( 0, std::ios::beg );
-    auto buff = std::make_unique< std::uint8_t[] >( size );
-    if( !file.read( (char *)buff.get(), size ) )
-        throw FLAC::exception( "read_file: read file error" );
-    return std::make_tuple( std::move( buff ), size );
+    wave_format wf;
+    wf.channels = sd.channels();
+    wf.bits_per_sample = sd.bits_per_sample;
+    wf.samples = sd.samples;
+    wf.sample_rate = sd.sample_rate;
+    print_wave_format( wf );
 }
 
-sound_data decode_wavefile( char const *filename )
+constexpr std::size_t WAVE_HEADER_SIZE = 44;
+
+wave_reader::wave_reader( char const *filename )
+    : file( filename, std::ios::binary )
 {
-    std::unique_ptr< std::uint8_t[] > buff;
-    std::size_t filesize;
-    std::tie( buff, filesize ) = read_file( filename );
-    buffer::bytestream<> bs( buffer::buffer( std::move( buff ), filesize ) );
+    if( !file )
+        throw FLAC::exception( "wave_reader: open file error" );
+    auto header = std::make_unique< std::uint8_t[] >( WAVE_HEADER_SIZE );
+    if( !file.read( (char *)header.get(), WAVE_HEADER_SIZE ) )
+        throw FLAC::exception( "wave_reader: read file error" );
+    buffer::bytestream<> bs( buffer::buffer( std::move( header ), WAVE_HEADER_SIZE ) );
     auto le = buffer::make_bytestream_le( bs );
-    sound_data sd;
     if( std::memcmp( bs.get_bytes( 4 ).get(), "RIFF", 4 ) != 0 )
-        throw FLAC::exception( "decode_wavefile: not riff file" );
+        throw FLAC::exception( "wave_reader: not riff file" );
     bs.get_bytes( 4 );
     if( std::memcmp( bs.get_bytes( 4 ).get(), "WAVE", 4 ) != 0 )
-        throw FLAC::exception( "decode_wavefile: not wave file" );
+        throw FLAC::exception( "wave_reader: not wave file" );
     if( std::memcmp( bs.get_bytes( 4 ).get(), "fmt ", 4 ) != 0 )
-        throw FLAC::exception( "decode_wavefile: not wave file?" );
+        throw FLAC::exception( "wave_reader: not wave file?" );
     if( le.get32() != 0x10 )
-        throw FLAC::exception( "decode_wavefile: fmt's size must be 0x10" );
+        throw FLAC::exception( "wave_reader: fmt's size must be 0x10" );
     if( le.get16() != 1 )
-        throw FLAC::exception( "decode_wavefile: only support integer lpcm" );
-    std::uint16_t const ch_num = le.get16();
-    sd.sample_rate = le.get32();
+        throw FLAC::exception( "wave_reader: only support integer lpcm" );
+    std::uint16_t const ch_num = format.channels = le.get16();
+    format.sample_rate = le.get32();
     std::uint32_t const dataspeed = le.get32();
     std::uint16_t const blocksize = le.get16();
-    std::uint16_t const bps = sd.bits_per_sample = le.get16();
+    std::uint16_t const bps = format.bits_per_sample = le.get16();
+    if( bps == 0 || bps % 8 != 0 || bps > 32 )
+        throw FLAC::exception( "wave_reader: unsupported bits per sample" );
     if( blocksize != bps / 8 * ch_num )
-        throw FLAC::exception( "decode_wavefile: blocksize is wrong" );
-    if( dataspeed != bps / 8 * ch_num * sd.sample_rate )
-        throw FLAC::exception( "decode_wavefile: dataspeed is wrong" );
+        throw FLAC::exception( "wave_reader: blocksize is wrong" );
+    if( dataspeed != bps / 8 * ch_num * format.sample_rate )
+        throw FLAC::exception( "wave_reader: dataspeed is wrong" );
     if( std::memcmp( bs.get_bytes( 4 ).get(), "data", 4 ) != 0 )
-        throw FLAC::exception( "decode_wavefile: not wave file??" );
+        throw FLAC::exception( "wave_reader: not wave file??" );
     std::size_t const size = le.get32();
     if( size % blocksize != 0 )
-        throw FLAC::exception( "decode_wavefile: data size is wrong" );
-    std::size_t const sample_num = sd.samples = size / blocksize;
-    for( std::uint16_t ch = 0; ch < ch_num; ++ch )
-        sd.wave.emplace_back( std::make_unique< std::int64_t[] >( sample_num ) );
-    for( std::size_t i = 0; i < sample_num; ++i )
-        for( std::uint16_t ch = 0; ch < ch_num; ++ch )
-            sd.wave[ ch ][ i ] = le.get_int( bps / 8 );
-    return std::move( sd );
+        throw FLAC::exception( "wave_reader: data size is wrong" );
+    format.samples = size / blocksize;
+}
+
+sound_data wave_reader::read( std::uint64_t samples, buffer::buffer *const pcm )
+{
+    samples = std::min( samples, format.samples - position );
+    std::uint8_t const bytes = format.bits_per_sample / 8;
+    std::size_t const size = samples * bytes * format.channels;
+    if( raw_size < size )
+    {
+        raw = std::make_unique< std::uint8_t[] >( size );
+        raw_size = size;
+    }
+    if( !file.read( (char *)raw.get(), size ) )
+        throw FLAC::exception( "wave_reader::read: read file error" );
+    sound_data sd;
+    sd.bits_per_sample = format.bits_per_sample;
+    sd.samples = samples;
+    sd.sample_rate = format.sample_rate;
+    unsigned int const unused = 32 - format.bits_per_sample;
+    std::uint8_t const *p = raw.get();
+    auto deinterleave = [ & ]( auto &wave )
+    {
+        using sample_type = typename std::remove_reference_t< decltype( wave ) >::value_type::element_type;
+        for( std::uint16_t ch = 0; ch < format.channels; ++ch )
+            wave.emplace_back( std::make_unique< sample_type[] >( samples ) );
+        for( std::size_t i = 0; i < samples; ++i )
+            for( std::uint16_t ch = 0; ch < format.channels; ++ch )
+            {
+                std::uint32_t v = 0;
+                for( std::uint8_t b = 0; b < bytes; ++b )
+                    v |= static_cast< std::uint32_t >( *p++ ) << (8 * b);
+                wave[ ch ][ i ] = static_cast< sample_type >( static_cast< std::int32_t >( v << unused ) >> unused );
+            }
+    };
+    if( format.bits_per_sample <= 16 )
+        deinterleave( sd.wave16 );
+    else
+        deinterleave( sd.wave32 );
+    // the raw data are exactly the samples in sd, interleaved; it is handed over instead of reused
+    if( pcm )
+    {
+        *pcm = buffer::buffer( std::move( raw ), size );
+        raw_size = 0;
+    }
+    position += samples;
+    return sd;
+}
+
+output_file::output_file( char const *filename )
+    : fd( ::open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666 ) )
+{
+    if( fd < 0 )
+        throw FLAC::exception( "output_file: open file error" );
+    struct stat st;
+    regular = ::fstat( fd, &st ) == 0 && S_ISREG( st.st_mode );
+}
+output_file::~output_file()
+{
+    if( fd >= 0 )
+        ::close( fd );
+}
+void output_file::preallocate( std::uint64_t const size ) noexcept
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    ::fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, size ); // only a hint, failures do not matter
+#else
+    static_cast< void >( size );
+#endif
+}
+void output_file::append( std::uint8_t const *const *data, std::size_t const *sizes, std::size_t const count )
+{
+    std::vector< iovec > iov;
+    for( std::size_t i = 0; i < count; ++i )
+        if( sizes[ i ] != 0 )
+            iov.push_back( { const_cast< std::uint8_t* >( data[ i ] ), sizes[ i ] } );
+    // writev may write less than asked; continue behind the written bytes
+    std::size_t first = 0;
+    while( first < iov.size() )
+    {
+        ssize_t written = ::writev( fd, iov.data() + first, static_cast< int >( std::min< std::size_t >( iov.size() - first, IOV_MAX ) ) );
+        if( written < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            throw FLAC::exception( "output_file: write error" );
+        }
+        size += written;
+        for( ; first < iov.size() && static_cast< std::size_t >( written ) >= iov[ first ].iov_len; ++first )
+            written -= iov[ first ].iov_len;
+        if( first < iov.size() )
+        {
+            iov[ first ].iov_base = static_cast< std::uint8_t* >( iov[ first ].iov_base ) + written;
+            iov[ first ].iov_len -= written;
+        }
+    }
+}
+void output_file::write_at( std::uint64_t offset, std::uint8_t const *data, std::size_t bytes )
+{
+    if( offset + bytes > size )
+        throw FLAC::exception( "output_file: write_at behind the end" );
+    while( bytes != 0 )
+    {
+        ssize_t const written = ::pwrite( fd, data, bytes, offset );
+        if( written < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( errno == ESPIPE )
+                throw FLAC::exception( "output_file: the output is not seekable" );
+            throw FLAC::exception( "output_file: write error" );
+        }
+        data += written;
+        bytes -= written;
+        offset += written;
+    }
+}
+void output_file::close()
+{
+    int const f = fd;
+    fd = -1;
+    if( regular && ::ftruncate( f, size ) != 0 )
+    {
+        ::close( f );
+        throw FLAC::exception( "output_file: truncate error" );
+    }
+    if( ::close( f ) != 0 )
+        throw FLAC::exception( "output_file: close error" );
+}
+
+sound_data decode_wavefile( char const *filename )
+{
+    wave_reader reader( filename );
+    return reader.read( reader.get_format().samples );
 }
 
 } // namespace
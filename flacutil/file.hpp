@@ -1,21 +1,122 @@
 #ifndef FLACUTIL_FILE_HPP
 #define FLACUTIL_FILE_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <fstream>
 #include <memory>
 #include <vector>
+#include "buffer.hpp"
 
 namespace file
 {
 
+// planar samples, stored in wave16 when bits_per_sample <= 16 and in wave32 otherwise
 struct sound_data
 {
-    std::vector< std::unique_ptr< std::int64_t[] > > wave;
+    std::vector< std::unique_ptr< std::int16_t[] > > wave16;
+    std::vector< std::unique_ptr< std::int32_t[] > > wave32;
     std::uint8_t                                     bits_per_sample;
     std::uint64_t                                    samples;
     std::uint32_t                                    sample_rate;
+
+    std::size_t channels() const noexcept
+    {
+        return bits_per_sample <= 16 ? wave16.size() : wave32.size();
+    }
+};
+// the samples of channel ch; T must be the storage type of sd
+template< typename T >
+T const *get_channel( sound_data const &sd, std::size_t ch ) noexcept;
+template<>
+inline std::int16_t const *get_channel< std::int16_t >( sound_data const &sd, std::size_t const ch ) noexcept
+{
+    return sd.wave16[ ch ].get();
+}
+template<>
+inline std::int32_t const *get_channel< std::int32_t >( sound_data const &sd, std::size_t const ch ) noexcept
+{
+    return sd.wave32[ ch ].get();
+}
+
+struct wave_format
+{
+    std::uint16_t channels;
+    std::uint8_t  bits_per_sample;
+    std::uint64_t samples;
+    std::uint32_t sample_rate;
+};
+
+// reads the PCM of a wave file in chunks
+class wave_reader
+{
+private:
+    std::ifstream                     file;
+    wave_format                       format;
+    std::uint64_t                     position = 0;
+    std::unique_ptr< std::uint8_t[] > raw;
+    std::size_t                       raw_size = 0;
+
+public:
+    explicit wave_reader( char const *filename );
+    wave_format const &get_format() const noexcept
+    {
+        return format;
+    }
+    std::uint64_t get_position() const noexcept
+    {
+        return position;
+    }
+    bool is_end() const noexcept
+    {
+        return position >= format.samples;
+    }
+    // read the next min( samples, rest ) samples
+    // pcm: if not null, receives the interleaved little endian signed samples, the bytes the
+    // STREAMINFO MD5 is computed from
+    sound_data read( std::uint64_t samples, buffer::buffer *pcm = nullptr );
+};
+
+// Output written with gathered and positioned writes (writev/pwrite), straight from the
+// buffers of the caller without copying them into a stream buffer.
+class output_file
+{
+private:
+    int           fd;
+    std::uint64_t size = 0;        // the bytes appended
+    bool          regular = false; // not a pipe or a device
+
+public:
+    explicit output_file( char const *filename );
+    output_file( output_file const & ) = delete;
+    output_file &operator=( output_file const & ) = delete;
+    ~output_file();
+
+    std::uint64_t get_size() const noexcept
+    {
+        return size;
+    }
+    // only a regular file can be overwritten reliably, and is cut by close()
+    bool is_regular() const noexcept
+    {
+        return regular;
+    }
+    // Reserve disk space for size bytes without changing the file size, where the file system
+    // supports it; the space beyond the written data is released by close().
+    void preallocate( std::uint64_t size ) noexcept;
+    // write the count buffers one after another at the end of the file
+    void append( std::uint8_t const *const *data, std::size_t const *sizes, std::size_t count );
+    void append( std::uint8_t const *data, std::size_t const bytes )
+    {
+        append( &data, &bytes, 1 );
+    }
+    // overwrite data that was appended before
+    void write_at( std::uint64_t offset, std::uint8_t const *data, std::size_t bytes );
+    // cut a regular file to the appended size and close it
+    void close();
 };
 
+void print_wave_format( wave_format const &wf );
 void print_sound_data( sound_data const &sd );
 sound_data decode_wavefile( char const *filnemae );
 
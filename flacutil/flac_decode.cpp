@@ -1,6 +1,7 @@
 #include <iostream>
 #include "flac_decode.hpp"
 #include "flac_struct.hpp"
+#include "metrics.hpp"
 
 namespace FLAC
 {
@@ -90,6 +91,7 @@ void DecodeVerbatim( std::int64_t *buff, Subframe::Verbatim const &v, std::uint1
 }
 void DecodeSubframe( std::int64_t *buff, Subframe::Subframe const &s, std::uint16_t const blocksize ) noexcept
 {
+    metrics::timer timer( metrics::stage::PREDICTION );
     switch( s.header.type )
     {
     case Subframe::Type::CONSTANT:
@@ -1,19 +1,27 @@
+#include <algorithm>
 #include <cstdint>
 #include <cmath>
 #include <cstring>
 #include <limits>
+#include <memory>
 #include <tuple>
+#include <utility>
 #include <iostream>
 
+#include "arena.hpp"
 #include "flac_encode.hpp"
+#include "metrics.hpp"
+#include "simd.hpp"
 
 namespace FLAC
 {
 
 constexpr std::size_t RICE_LEN = 31;
+constexpr std::uint8_t MAX_RAW_BITS = (1u << 5) - 1;
 struct rice_search_data
 {
-    std::uint64_t num[ RICE_LEN ];
+    std::uint64_t num[ RICE_LEN ]; // sum of (zigzag encoded residual >> k)
+    std::uint64_t mask;            // OR of the zigzag encoded residuals, whose length is the escape width
 };
 
 static
@@ -28,43 +36,86 @@ std::uint8_t MaxRicePartitionOrder( std::uint8_t const predict_order, std::uint1
     }
     return (1u << 4) - 1;
 }
+// num[ k ] = sum of (us >> k) = sum over bits b >= k of (count of us with bit b set) << (b - k),
+// so it is built from per-bit counts, which are vectorized, instead of a loop over k for every sample.
 static
-std::unique_ptr< rice_search_data[] > MakeRiceSearchData( std::int64_t const *residual, std::uint8_t const part_order, std::uint8_t const predict_order, std::uint16_t const blocksize )
+void MakeRiceSearchData( EncodeWorkspace &ws, std::int64_t const *residual, std::uint8_t const part_order, std::uint8_t const predict_order, std::uint16_t const blocksize )
 {
+    rice_search_data *data = ws.rice_data.get();
+    std::uint32_t *zigzag = ws.zigzag.get();
     std::uint16_t const max_partitions = 1u << part_order;
-    auto data = std::make_unique< rice_search_data[] >( max_partitions );
+    std::fill( data, data + max_partitions, rice_search_data{} );
     std::uint16_t const default_sample_num = blocksize >> part_order;
     std::uint16_t sample = 0;
     for( std::uint16_t part = 0; part < max_partitions; ++part )
     {
         std::uint16_t const this_sample_num = part == 0 ? default_sample_num - predict_order : default_sample_num;
-        for( std::uint16_t j = 0; j < this_sample_num; ++j, ++sample )
+        // separate pass without data dependent exits, so that it is vectorized
+        std::uint64_t mask = 0;
+        for( std::uint16_t j = 0; j < this_sample_num; ++j )
         {
-            std::int64_t const s = residual[ sample ];
-            std::uint64_t us = s >= 0 ? static_cast< std::uint64_t >( s ) << 1 : (static_cast< std::uint64_t >( -s ) << 1) - 1;
-            for( unsigned int k = 0; us && k < RICE_LEN; ++k, us >>= 1 )
-                data[ part ].num[ k ] += us;
+            std::int64_t const s = residual[ sample + j ];
+            std::uint64_t const us = (static_cast< std::uint64_t >( s ) << 1) ^ static_cast< std::uint64_t >( s >> 63 );
+            mask |= us;
+            zigzag[ j ] = static_cast< std::uint32_t >( us );
         }
+        data[ part ].mask = mask;
+        std::uint8_t kmax = 0;
+        for( std::uint64_t m = mask; m; m >>= 1 )
+            ++kmax;
+        if( kmax <= 32 )
+        {
+            std::uint64_t count[ 32 ] = {};
+            simd::add_bit_counts( zigzag, this_sample_num, kmax, count );
+            std::uint64_t num = 0;
+            for( int k = kmax - 1; k >= 0; --k )
+            {
+                num = 2 * num + count[ k ];
+                if( k < static_cast< int >( RICE_LEN ) )
+                    data[ part ].num[ k ] = num;
+            }
+        }
+        else
+        {
+            for( std::uint16_t j = 0; j < this_sample_num; ++j )
+            {
+                std::int64_t const s = residual[ sample + j ];
+                std::uint64_t us = s >= 0 ? static_cast< std::uint64_t >( s ) << 1 : (static_cast< std::uint64_t >( -s ) << 1) - 1;
+                for( unsigned int k = 0; us && k < RICE_LEN; ++k, us >>= 1 )
+                    data[ part ].num[ k ] += us;
+            }
+        }
+        sample += this_sample_num;
     }
-    return std::move( data );
 }
+// turn the statistics of the partitions of order + 1 into those of order, in place
 static
-std::tuple< std::uint64_t, bool > FindBestRiceParameterFixedPartitions( std::uint8_t const order, std::uint8_t *buff, rice_search_data const *data, std::uint8_t const max_order, std::uint8_t const predict_order, std::uint16_t const blocksize)
+void MergeRiceSearchData( rice_search_data *data, std::uint8_t const order ) noexcept
+{
+    for( std::uint32_t part = 0; part < (1u << order); ++part )
+    {
+        for( unsigned int m = 0; m < RICE_LEN; ++m )
+            data[ part ].num[ m ] = data[ 2 * part ].num[ m ] + data[ 2 * part + 1 ].num[ m ];
+        data[ part ].mask = data[ 2 * part ].mask | data[ 2 * part + 1 ].mask;
+    }
+}
+// data holds the statistics of the 1 << order partitions.
+// A partition is escaped (raw bits) when that is cheaper than its best rice parameter;
+// its parameter is the raw width then. buff and raw_buff may be null when only the bits are needed.
+// The lower bound is the cost without any partition header; merging partitions never decreases it.
+// return: bits, is_rice2, lower bound of the bits of any smaller order
+static
+std::tuple< std::uint64_t, bool, std::uint64_t > FindBestRiceParameterFixedPartitions( std::uint8_t const order, std::uint8_t *buff, bool *raw_buff, rice_search_data const *data, std::uint8_t const predict_order, std::uint16_t const blocksize)
 {
-    if( order > max_order )
-        throw exception( "FindBestRiceParameterFixedPartitions: order is too big" );
     std::uint16_t const default_sample = blocksize >> order;
     std::uint16_t const partitions = 1u << order;
-    std::uint16_t const same_part_num = 1u << (max_order - order);
-    std::uint16_t part_index = 0;
     std::uint64_t bits = 0;
+    std::uint64_t lower_bound = 0;
     bool is_rice2 = false;
     for( std::uint16_t part = 0; part < partitions; ++part )
     {
-        std::uint64_t sum[ RICE_LEN ] = {};
-        for( std::uint16_t i = 0; i < same_part_num; ++i, ++part_index )
-            for( unsigned int m = 0; m < RICE_LEN; ++m )
-                sum[ m ] += data[ part_index ].num[ m ];
+        std::uint64_t const *sum = data[ part ].num;
+        std::uint64_t mask = data[ part ].mask;
         std::uint64_t min_part_bits = std::numeric_limits< decltype( min_part_bits ) >::max();
         std::uint8_t min_part_param = 0;
         std::uint16_t this_sample_num = part == 0 ? default_sample - predict_order : default_sample;
@@ -79,105 +130,611 @@ std::tuple< std::uint64_t, bool > FindBestRiceParameterFixedPartitions( std::uin
             if( sum[ l ] == 0 )
                 break;
         }
-        bits += min_part_bits;
-        buff[ part ] = min_part_param;
-        if( min_part_param > 14 )
+        std::uint8_t raw_width = 0;
+        for( ; mask; mask >>= 1 )
+            ++raw_width;
+        std::uint64_t const raw_bits = static_cast< std::uint64_t >( raw_width ) * this_sample_num;
+        lower_bound += raw_width <= MAX_RAW_BITS ? std::min( min_part_bits, raw_bits ) : min_part_bits;
+        bool const is_raw = raw_width <= MAX_RAW_BITS && 5 + raw_bits < min_part_bits;
+        if( is_raw )
+        {
+            min_part_bits = 5 + raw_bits;
+            min_part_param = raw_width;
+        }
+        else if( min_part_param > 14 )
             is_rice2 = true;
+        bits += min_part_bits;
+        if( buff )
+        {
+            buff[ part ] = min_part_param;
+            raw_buff[ part ] = is_raw;
+        }
     }
     bits += (is_rice2 ? 5 : 4 ) * partitions;
-    return std::make_tuple( bits, is_rice2 );
+    return std::make_tuple( bits, is_rice2, lower_bound );
 }
+// The best partitioning is stored in *rice unless it is null.
+// return: bits (with the coding method), is_rice2
 static
-std::tuple< Subframe::PartitionedRice, Subframe::EntropyCodingMethodType, std::uint64_t > FindBestRiceParameter( std::int64_t const *residual, std::uint8_t const predict_order, std::uint16_t const blocksize )
+std::tuple< std::uint64_t, bool > SearchRiceParameter( EncodeWorkspace &ws, std::int64_t const *residual, std::uint8_t const predict_order, std::uint16_t const blocksize, EncodeParameters const &param, Subframe::PartitionedRice *rice )
 {
-    Subframe::PartitionedRice rice;
-    std::uint8_t const max_order = MaxRicePartitionOrder( predict_order, blocksize );
+    metrics::timer timer( metrics::stage::RICE_SEARCH );
+    std::uint8_t const max_order = std::min( MaxRicePartitionOrder( predict_order, blocksize ), param.max_partition_order );
+    std::uint8_t const min_order = std::min( param.min_partition_order, max_order );
     std::uint16_t const max_partitions = 1u << max_order;
-    auto data = MakeRiceSearchData( residual, max_order, predict_order, blocksize );
-    
+    ws.reserve( blocksize, max_order );
+    MakeRiceSearchData( ws, residual, max_order, predict_order, blocksize );
+
     std::uint64_t min_bits = std::numeric_limits< decltype( min_bits ) >::max();
     std::uint8_t min_bits_order = std::numeric_limits< decltype( min_bits_order ) >::max();
     bool min_bits_is_rice2 = false;
-    auto min_bits_parameters = std::make_unique< std::uint8_t[] >( max_partitions ), buff = std::make_unique< std::uint8_t[] >( max_partitions );
-    for( std::uint8_t order = 0; order <= max_order; ++order )
+    arena::array< std::uint8_t > buff;
+    arena::array< bool > raw_buff;
+    if( rice )
+    {
+        rice->parameters = arena::make_array< std::uint8_t >( max_partitions );
+        rice->is_raw_bits = arena::make_array< bool >( max_partitions );
+        buff = arena::make_array< std::uint8_t >( max_partitions );
+        raw_buff = arena::make_array< bool >( max_partitions );
+    }
+    // from the finest partitioning to the coarsest, merging pairs of partitions on the way;
+    // ties go to the smaller order
+    for( std::uint8_t order = max_order; ; --order )
     {
-        std::uint64_t bits;
+        std::uint64_t bits, lower_bound;
         bool is_rice2;
-        std::tie( bits, is_rice2 ) = FindBestRiceParameterFixedPartitions( order, buff.get(), data.get(), max_order, predict_order, blocksize );
-        if( bits < min_bits )
+        std::tie( bits, is_rice2, lower_bound ) = FindBestRiceParameterFixedPartitions( order, buff.get(), raw_buff.get(), ws.rice_data.get(), predict_order, blocksize );
+        if( bits <= min_bits )
         {
             min_bits = bits;
             min_bits_order = order;
             min_bits_is_rice2 = is_rice2;
-            std::swap( min_bits_parameters, buff );
+            if( rice )
+            {
+                std::swap( rice->parameters, buff );
+                std::swap( rice->is_raw_bits, raw_buff );
+            }
         }
+        // every smaller order costs at least lower_bound plus 4 bits for each of its partitions
+        if( order == min_order || lower_bound + (4u << min_order) > min_bits )
+            break;
+        MergeRiceSearchData( ws.rice_data.get(), order - 1 );
     }
-    rice.order = min_bits_order;
-    rice.parameters = std::move( min_bits_parameters );
-    rice.is_raw_bits = std::make_unique< bool[] >( 1u << rice.order );
-    for( std::uint16_t i = 0; i < (1u << rice.order); ++i )
-        rice.is_raw_bits[ i ] = false;
-    return std::make_tuple( std::move( rice ), !min_bits_is_rice2 ? Subframe::EntropyCodingMethodType::PARTITIONED_RICE : Subframe::EntropyCodingMethodType::PARTITIONED_RICE2, min_bits );
+    if( rice )
+        rice->order = min_bits_order;
+    return std::make_tuple( min_bits + 2, min_bits_is_rice2 );
 }
 // set res.residual before call
 static
-std::uint64_t FindBestResidualParameter( Subframe::Residual &res, std::uint8_t const predict_order, std::uint16_t const blocksize )
+std::uint64_t FindBestResidualParameter( EncodeWorkspace &ws, Subframe::Residual &res, std::uint8_t const predict_order, std::uint16_t const blocksize, EncodeParameters const &param )
 {
-    auto t = FindBestRiceParameter( res.residual.get(), predict_order, blocksize );
-    res.type = std::get< 1 >( t );
-    res.data = std::move( std::get< 0 >( t ) );
-    return std::get< 2 >( t ) + 2;
-}
-
-std::tuple< Subframe::Constant, std::uint64_t > EncodeConstant( std::int64_t const *src, std::uint8_t const bps, std::uint16_t const blocksize )
-{
-    Subframe::Constant co;
-    co.value = src[ 0 ];
-    return std::make_tuple( std::move( co ), bps );
+    Subframe::PartitionedRice rice;
+    std::uint64_t bits;
+    bool is_rice2;
+    std::tie( bits, is_rice2 ) = SearchRiceParameter( ws, res.residual.get(), predict_order, blocksize, param, &rice );
+    res.type = !is_rice2 ? Subframe::EntropyCodingMethodType::PARTITIONED_RICE : Subframe::EntropyCodingMethodType::PARTITIONED_RICE2;
+    res.data = std::move( rice );
+    return bits;
 }
-std::tuple< Subframe::Fixed, std::uint64_t > EncodeFixed( std::int64_t const *src, std::uint8_t const bps, std::uint8_t const order, std::uint16_t const blocksize )
+template< typename T >
+static
+void ComputeFixedResidual( T const *src, std::uint8_t const order, std::uint16_t const blocksize, std::int64_t *residual )
 {
-    if( order >= blocksize )
-        throw exception( "EncodeFixed: order must be smaller than blocksize" );
-    Subframe::Fixed f;
-    f.order = order;
-    for( std::uint8_t i = 0; i < order; ++i )
-        f.warmup[ i ] = src[ i ];
-    f.residual.residual = std::make_unique< std::int64_t[] >( blocksize - order );
+    auto x = [ src ]( std::uint16_t const i ){ return static_cast< std::int64_t >( src[ i ] ); };
     switch( order )
     {
     case 0:
         for( std::uint16_t i = order; i < blocksize; ++i )
-            f.residual.residual[ i - order ] = src[ i ];
+            residual[ i - order ] = x( i );
         break;
     case 1:
         for( std::uint16_t i = order; i < blocksize; ++i )
-            f.residual.residual[ i - order ] = src[ i ] - src[ i - 1 ];
+            residual[ i - order ] = x( i ) - x( i - 1 );
         break;
     case 2:
         for( std::uint16_t i = order; i < blocksize; ++i )
-            f.residual.residual[ i - order ] = src[ i ] - 2 * src[ i - 1 ] + src[ i - 2 ];
+            residual[ i - order ] = x( i ) - 2 * x( i - 1 ) + x( i - 2 );
         break;
     case 3:
         for( std::uint16_t i = order; i < blocksize; ++i )
-            f.residual.residual[ i - order ] = src[ i ] - 3 * src[ i - 1 ] + 3 * src[ i - 2 ] - src[ i - 3 ];
+            residual[ i - order ] = x( i ) - 3 * x( i - 1 ) + 3 * x( i - 2 ) - x( i - 3 );
         break;
     case 4:
         for( std::uint16_t i = order; i < blocksize; ++i )
-            f.residual.residual[ i - order ] = src[ i ] - 4 * src[ i - 1 ] + 6 * src[ i - 2 ] - 4 * src[ i - 3 ] + src[ i - 4 ];
+            residual[ i - order ] = x( i ) - 4 * x( i - 1 ) + 6 * x( i - 2 ) - 4 * x( i - 3 ) + x( i - 4 );
+        break;
+    default:
+        throw exception( "ComputeFixedResidual: unknown order" );
+    }
+}
+
+constexpr std::uint8_t  MAX_LPC_SHIFT       = (1u << 4) - 1; // quantization_level is 5 bits and must be positive here
+static
+std::uint8_t ilog2( std::uint32_t v ) noexcept
+{
+    std::uint8_t l = 0;
+    while( v >>= 1 )
+        ++l;
+    return l;
+}
+bool operator==( Apodization const &lhs, Apodization const &rhs ) noexcept
+{
+    return lhs.type == rhs.type && lhs.p == rhs.p && lhs.start == rhs.start && lhs.end == rhs.end;
+}
+// window[ 0 .. blocksize - 1 ]
+static
+void MakeWindow( Apodization const &apodization, std::uint16_t const blocksize, double *window )
+{
+    constexpr double pi = 3.14159265358979323846;
+    auto const bound = [ & ]( double const f ) {
+        return static_cast< std::int32_t >( std::min( 1.0, std::max( 0.0, f ) ) * blocksize + 0.5 );
+    };
+    std::int32_t const first = bound( apodization.start );
+    std::int32_t const last = std::max( first, bound( apodization.end ) );
+    std::int32_t const length = last - first;
+    std::fill( window, window + blocksize, 0.0 );
+    double *const w = window + first;
+    if( length == 1 )
+    {
+        w[ 0 ] = 1.0;
+        return;
+    }
+    double const n = length - 1;
+    switch( apodization.type )
+    {
+    case Window::RECTANGLE:
+        std::fill( w, w + length, 1.0 );
+        break;
+    case Window::BARTLETT:
+        for( std::int32_t i = 0; i < length; ++i )
+            w[ i ] = 1.0 - std::fabs( 2.0 * i / n - 1.0 );
+        break;
+    case Window::HANN:
+        for( std::int32_t i = 0; i < length; ++i )
+            w[ i ] = 0.5 - 0.5 * std::cos( 2.0 * pi * i / n );
+        break;
+    case Window::WELCH:
+        for( std::int32_t i = 0; i < length; ++i )
+        {
+            double const x = 2.0 * i / n - 1.0;
+            w[ i ] = 1.0 - x * x;
+        }
         break;
+    case Window::TUKEY:
+    {
+        std::fill( w, w + length, 1.0 );
+        std::int32_t const np = static_cast< std::int32_t >( std::min( 1.0, apodization.p ) / 2 * length ) - 1;
+        if( np <= 0 )
+            break;
+        for( std::int32_t i = 0; i <= np; ++i )
+        {
+            w[ i ]                   *= 0.5 - 0.5 * std::cos( pi * i / np );
+            w[ length - np - 1 + i ] *= 0.5 - 0.5 * std::cos( pi * (i + np) / np );
+        }
+        break;
+    }
     default:
-        throw exception( "EncodeFixed: unknown order" );
+        throw exception( "MakeWindow: unknown window" );
+    }
+}
+template< typename T >
+static
+void ApplyWindow( double *dst, T const *src, double const *window, std::uint16_t const blocksize )
+{
+    for( std::uint16_t i = 0; i < blocksize; ++i )
+        dst[ i ] = static_cast< double >( src[ i ] ) * window[ i ];
+}
+// autoc[ 0 .. max_lag ]
+static
+void Autocorrelation( double const *data, std::uint16_t const blocksize, std::uint8_t const max_lag, double *autoc )
+{
+    double sum[ MAX_LPC_ORDER + 1 ] = {};
+    std::uint32_t const lags = max_lag + 1u;
+    std::uint32_t i = 0;
+    // inner loop runs over independent accumulators, so it vectorizes without reassociating
+    for( ; i + lags <= blocksize; ++i )
+    {
+        double const d = data[ i ];
+        for( std::uint32_t l = 0; l < lags; ++l )
+            sum[ l ] += d * data[ i + l ];
+    }
+    for( ; i < blocksize; ++i )
+    {
+        double const d = data[ i ];
+        for( std::uint32_t l = 0; i + l < blocksize; ++l )
+            sum[ l ] += d * data[ i + l ];
+    }
+    std::copy( sum, sum + lags, autoc );
+}
+// lp_coeff[ order - 1 ][ 0 .. order - 1 ], error[ order - 1 ]
+// return: usable max order
+static
+std::uint8_t LevinsonDurbin( double const *autoc, std::uint8_t const max_order, double (*lp_coeff)[ MAX_LPC_ORDER ], double *error )
+{
+    double lpc[ MAX_LPC_ORDER ] = {};
+    double err = autoc[ 0 ];
+    for( std::uint8_t i = 0; i < max_order; ++i )
+    {
+        double r = -autoc[ i + 1 ];
+        for( std::uint8_t j = 0; j < i; ++j )
+            r -= lpc[ j ] * autoc[ i - j ];
+        r /= err;
+        lpc[ i ] = r;
+        std::uint8_t j = 0;
+        for( ; j < (i >> 1); ++j )
+        {
+            double const tmp = lpc[ j ];
+            lpc[ j ] += r * lpc[ i - 1 - j ];
+            lpc[ i - 1 - j ] += r * tmp;
+        }
+        if( i & 1 )
+            lpc[ j ] += lpc[ j ] * r;
+        err *= 1.0 - r * r;
+        for( j = 0; j <= i; ++j )
+            lp_coeff[ i ][ j ] = -lpc[ j ];
+        error[ i ] = err;
+        if( err == 0.0 )
+            return i + 1;
+    }
+    return max_order;
+}
+static
+std::uint8_t DefaultQlpCoeffPrecision( std::uint8_t const bps, std::uint16_t const blocksize )
+{
+    if( bps < 16 )
+        return std::max< std::uint8_t >( MIN_QLP_COEFF_PRECISION, 2 + bps / 2 );
+    if( bps == 16 )
+    {
+        if( blocksize <=  192 ) return  7;
+        if( blocksize <=  384 ) return  8;
+        if( blocksize <=  576 ) return  9;
+        if( blocksize <= 1152 ) return 10;
+        if( blocksize <= 2304 ) return 11;
+        if( blocksize <= 4608 ) return 12;
+        return 13;
+    }
+    if( blocksize <=  384 ) return MAX_QLP_COEFF_PRECISION - 2;
+    if( blocksize <= 1152 ) return MAX_QLP_COEFF_PRECISION - 1;
+    return MAX_QLP_COEFF_PRECISION;
+}
+// keep 32bit arithmetic in the residual kernel (and in decoders) for <= 16bps(+1 for side channel)
+static
+std::uint8_t LimitQlpCoeffPrecision( std::uint8_t const precision, std::uint8_t const bps, std::uint8_t const order )
+{
+    if( bps > 17 )
+        return precision;
+    int const limit = 32 - bps - ilog2( order );
+    return static_cast< std::uint8_t >( std::max< int >( MIN_QLP_COEFF_PRECISION, std::min< int >( precision, limit ) ) );
+}
+static
+std::uint8_t EstimateBestLPCOrder( double const *error, std::uint8_t const max_order, std::uint8_t const bps, std::uint8_t const precision, std::uint16_t const blocksize )
+{
+    double const error_scale = 0.5 / blocksize;
+    double best_bits = std::numeric_limits< double >::max();
+    std::uint8_t best_order = 1;
+    for( std::uint8_t order = 1; order <= max_order; ++order )
+    {
+        double const err = error[ order - 1 ];
+        double bits_per_sample;
+        if( err > 0.0 )
+            bits_per_sample = std::max( 0.0, 0.5 * std::log2( error_scale * err ) );
+        else if( err < 0.0 )
+            bits_per_sample = 1e32;
+        else
+            bits_per_sample = 0.0;
+        double const bits = bits_per_sample * (blocksize - order) + static_cast< double >( order ) * (bps + precision);
+        if( bits < best_bits )
+        {
+            best_bits = bits;
+            best_order = order;
+        }
+    }
+    return best_order;
+}
+// return: false if lp_coeff can not be represented
+static
+bool QuantizeLPCCoefficients( double const *lp_coeff, std::uint8_t const order, std::uint8_t precision, std::int16_t *qlp_coeff, std::uint8_t &shift )
+{
+    --precision; // sign bit
+    std::int32_t const qmax = (1 << precision) - 1;
+    std::int32_t const qmin = -(1 << precision);
+    double cmax = 0.0;
+    for( std::uint8_t i = 0; i < order; ++i )
+        cmax = std::max( cmax, std::fabs( lp_coeff[ i ] ) );
+    if( cmax <= 0.0 )
+        return false;
+    int log2cmax;
+    std::frexp( cmax, &log2cmax );
+    int s = static_cast< int >( precision ) - log2cmax;
+    if( s > MAX_LPC_SHIFT )
+        s = MAX_LPC_SHIFT;
+    else if( s < 0 )
+        return false;
+    double error = 0.0;
+    for( std::uint8_t i = 0; i < order; ++i )
+    {
+        error += lp_coeff[ i ] * (1 << s);
+        std::int32_t q = static_cast< std::int32_t >( std::lround( error ) );
+        q = std::min( qmax, std::max( qmin, q ) );
+        error -= q;
+        qlp_coeff[ i ] = static_cast< std::int16_t >( q );
+    }
+    shift = static_cast< std::uint8_t >( s );
+    return true;
+}
+// Order is a template parameter so that the inner product is fully unrolled and the
+// loop over samples can be vectorized; Acc is std::int32_t when the sum can not overflow.
+template< std::uint8_t Order, typename Acc, typename T >
+static
+void ComputeLPCResidualImpl( T const *src, std::uint16_t const blocksize, std::int16_t const *qlp_coeff, std::uint8_t const shift, std::int64_t *residual )
+{
+    Acc coeff[ Order ];
+    for( std::uint8_t j = 0; j < Order; ++j )
+        coeff[ j ] = qlp_coeff[ j ];
+    for( std::uint32_t i = Order; i < blocksize; ++i )
+    {
+        Acc sum = 0;
+        for( std::uint8_t j = 0; j < Order; ++j )
+            sum += coeff[ j ] * static_cast< Acc >( src[ i - j - 1 ] );
+        residual[ i - Order ] = static_cast< std::int64_t >( src[ i ] ) - (sum >> shift);
+    }
+}
+template< typename Acc, typename T, std::size_t... Orders >
+static
+void ComputeLPCResidualDispatch( std::index_sequence< Orders... >, T const *src, std::uint16_t const blocksize, std::int16_t const *qlp_coeff, std::uint8_t const order, std::uint8_t const shift, std::int64_t *residual )
+{
+    using kernel = void (*)( T const *, std::uint16_t, std::int16_t const *, std::uint8_t, std::int64_t * );
+    static constexpr kernel table[] = { &ComputeLPCResidualImpl< Orders + 1, Acc, T >... };
+    table[ order - 1 ]( src, blocksize, qlp_coeff, shift, residual );
+}
+template< typename T >
+static
+void ComputeLPCResidual( T const *src, std::uint8_t const bps, std::uint16_t const blocksize, std::int16_t const *qlp_coeff, std::uint8_t const order, std::uint8_t const precision, std::uint8_t const shift, std::int64_t *residual )
+{
+    if( order < 1 || order > MAX_LPC_ORDER )
+        throw exception( "ComputeLPCResidual: order is out of range" );
+    if( bps + precision + ilog2( order ) <= 32 )
+        ComputeLPCResidualDispatch< std::int32_t >( std::make_index_sequence< MAX_LPC_ORDER >(), src, blocksize, qlp_coeff, order, shift, residual );
+    else
+        ComputeLPCResidualDispatch< std::int64_t >( std::make_index_sequence< MAX_LPC_ORDER >(), src, blocksize, qlp_coeff, order, shift, residual );
+}
+
+template< typename T >
+std::uint8_t CountWastedBits( T const *src, std::uint16_t const blocksize ) noexcept
+{
+    // plain OR reduction without early exit, so that it is vectorized
+    std::uint64_t acc = 0;
+    for( std::uint32_t i = 0; i < blocksize; ++i )
+        acc |= static_cast< std::uint64_t >( static_cast< std::int64_t >( src[ i ] ) );
+    if( acc == 0 )
+        return 0;
+    std::uint8_t wasted = 0;
+    while( !(acc & 1) )
+    {
+        acc >>= 1;
+        ++wasted;
+    }
+    return wasted;
+}
+
+EncodeWorkspace::EncodeWorkspace()
+    : blocksize_capacity( 0 )
+    , partitions_capacity( 0 )
+{
+}
+EncodeWorkspace::~EncodeWorkspace() = default;
+// blocksizes only vary at the end of the stream and in the variable blocksize search,
+// so the cache stays small; it is dropped if the parameters keep changing
+constexpr std::size_t MAX_CACHED_WINDOWS = 64;
+void EncodeWorkspace::reserve( std::uint16_t const blocksize, std::uint8_t const max_partition_order )
+{
+    if( blocksize > blocksize_capacity )
+    {
+        residual = std::make_unique< std::int64_t[] >( blocksize );
+        zigzag = std::make_unique< std::uint32_t[] >( blocksize );
+        fixed_residual = std::make_unique< std::int64_t[] >( (MAX_FIXED_ORDER + 1) * static_cast< std::size_t >( blocksize ) );
+        windowed = std::make_unique< double[] >( blocksize );
+        blocksize_capacity = blocksize;
+    }
+    std::uint32_t const partitions = 1u << max_partition_order;
+    if( partitions > partitions_capacity )
+    {
+        rice_data = std::make_unique< rice_search_data[] >( partitions );
+        partitions_capacity = partitions;
+    }
+}
+double const *EncodeWorkspace::window( Apodization const &apodization, std::uint16_t const blocksize )
+{
+    for( auto &&w : windows )
+        if( w.blocksize == blocksize && w.apodization == apodization )
+            return w.data.get();
+    if( windows.size() >= MAX_CACHED_WINDOWS )
+        windows.clear();
+    window_table w;
+    w.apodization = apodization;
+    w.blocksize = blocksize;
+    w.data = std::make_unique< double[] >( blocksize );
+    MakeWindow( apodization, blocksize, w.data.get() );
+    windows.emplace_back( std::move( w ) );
+    return windows.back().data.get();
+}
+
+static
+SubframeCandidate MakeCandidate( Subframe::Type const type, std::uint64_t const bits ) noexcept
+{
+    SubframeCandidate c = {};
+    c.type = type;
+    c.bits = bits;
+    return c;
+}
+SubframeCandidate EvaluateConstant( std::uint8_t const bps, std::uint16_t const )
+{
+    return MakeCandidate( Subframe::Type::CONSTANT, bps );
+}
+template< typename T >
+SubframeCandidate EvaluateFixed( EncodeWorkspace &ws, T const *src, std::uint8_t const bps, std::uint8_t const max_order, std::uint16_t const blocksize, EncodeParameters const &param )
+{
+    metrics::timer timer( metrics::stage::PREDICTION );
+    if( max_order >= blocksize || max_order > MAX_FIXED_ORDER )
+        throw exception( "EvaluateFixed: order is out of range" );
+    ws.reserve( blocksize, 0 );
+    // all orders in one pass
+    std::int64_t *residual[ MAX_FIXED_ORDER + 1 ];
+    for( std::uint8_t order = 0; order <= MAX_FIXED_ORDER; ++order )
+        residual[ order ] = ws.fixed_residual.get() + order * static_cast< std::size_t >( blocksize );
+    // the order 4 residual is bounded by 2^4 times the sample magnitude
+    simd::fixed_residuals( src, blocksize, bps + MAX_FIXED_ORDER <= 32, residual );
+    SubframeCandidate best = MakeCandidate( Subframe::Type::FIXED, std::numeric_limits< std::uint64_t >::max() );
+    for( std::uint8_t order = 0; order <= max_order; ++order )
+    {
+        std::uint64_t const bits = std::get< 0 >( SearchRiceParameter( ws, residual[ order ], order, blocksize, param, nullptr ) ) + bps * order;
+        if( bits < best.bits )
+        {
+            best.bits = bits;
+            best.order = order;
+        }
+    }
+    return best;
+}
+template< typename T >
+SubframeCandidate EvaluateLPC( EncodeWorkspace &ws, T const *src, std::uint8_t const bps, std::uint16_t const blocksize, EncodeParameters const &param )
+{
+    metrics::timer timer( metrics::stage::PREDICTION );
+    SubframeCandidate best = MakeCandidate( Subframe::Type::LPC, std::numeric_limits< std::uint64_t >::max() );
+    std::uint8_t const max_order = std::min< std::uint32_t >( { param.max_lpc_order, MAX_LPC_ORDER, blocksize - 1u } );
+    if( max_order == 0 )
+        return best;
+    ws.reserve( blocksize, 0 );
+    std::uint8_t const default_precision = DefaultQlpCoeffPrecision( bps, blocksize );
+    SubframeCandidate trial = best;
+    // only the quantization and the residual depend on the precision
+    auto const try_precision = [ & ]( double const *lp_coeff, std::uint8_t const order, std::uint8_t const precision ) {
+        std::uint8_t shift;
+        if( !QuantizeLPCCoefficients( lp_coeff, order, precision, trial.qlp_coeff, shift ) )
+            return false;
+        trial.order = order;
+        trial.qlp_coeff_precision = precision;
+        trial.quantization_level = shift;
+        ComputeLPCResidual( src, bps, blocksize, trial.qlp_coeff, order, precision, shift, ws.residual.get() );
+        trial.bits = std::get< 0 >( SearchRiceParameter( ws, ws.residual.get(), order, blocksize, param, nullptr ) ) + static_cast< std::uint64_t >( bps ) * order + 4 + 5 + static_cast< std::uint64_t >( precision ) * order;
+        if( trial.bits >= best.bits )
+            return false;
+        best = trial;
+        return true;
+    };
+    // every window is tried at the default precision, and the precisions are searched for the winner only
+    double best_lp_coeff[ MAX_LPC_ORDER ];
+    std::uint8_t best_order = 0; // 0: no coefficients yet
+    for( auto &&apodization : param.apodizations )
+    {
+        ApplyWindow( ws.windowed.get(), src, ws.window( apodization, blocksize ), blocksize );
+        double autoc[ MAX_LPC_ORDER + 1 ];
+        Autocorrelation( ws.windowed.get(), blocksize, max_order, autoc );
+        if( autoc[ 0 ] == 0.0 )
+            continue;
+        double lp_coeff[ MAX_LPC_ORDER ][ MAX_LPC_ORDER ];
+        double error[ MAX_LPC_ORDER ];
+        std::uint8_t const usable_order = LevinsonDurbin( autoc, max_order, lp_coeff, error );
+        std::uint8_t const order = EstimateBestLPCOrder( error, usable_order, bps, default_precision, blocksize );
+        std::uint8_t const precision = LimitQlpCoeffPrecision( default_precision, bps, order );
+        // keep the coefficients of the first window even if they do not quantize at the default precision
+        if( try_precision( lp_coeff[ order - 1 ], order, precision ) || best_order == 0 )
+        {
+            std::copy( lp_coeff[ order - 1 ], lp_coeff[ order - 1 ] + order, best_lp_coeff );
+            best_order = order;
+        }
+    }
+    if( param.search_qlp_coeff_precision && best_order != 0 )
+    {
+        std::uint8_t const tried = LimitQlpCoeffPrecision( default_precision, bps, best_order );
+        std::uint8_t const max_precision = LimitQlpCoeffPrecision( MAX_QLP_COEFF_PRECISION, bps, best_order );
+        for( std::uint8_t precision = MIN_QLP_COEFF_PRECISION; precision <= max_precision; ++precision )
+            if( precision != tried )
+                try_precision( best_lp_coeff, best_order, precision );
     }
-    std::uint64_t const bits = FindBestResidualParameter( f.residual, order, blocksize );
-    return std::make_tuple( std::move( f ), bits + bps * order );
+    return best;
 }
-std::tuple< Subframe::Verbatim, std::uint64_t > EncodeVerbatim( std::int64_t const *src, std::uint8_t const bps, std::uint16_t const blocksize )
+SubframeCandidate EvaluateVerbatim( std::uint8_t const bps, std::uint16_t const blocksize )
 {
-    Subframe::Verbatim ver;
-    ver.data = std::make_unique< std::int64_t[] >( blocksize );
-    std::memcpy( ver.data.get(), src, sizeof( std::int64_t ) * blocksize );
-    return std::make_tuple( std::move( ver ), bps * blocksize );
+    return MakeCandidate( Subframe::Type::VERBATIM, static_cast< std::uint64_t >( bps ) * blocksize );
 }
+template< typename T >
+Subframe::Subframe BuildSubframe( EncodeWorkspace &ws, SubframeCandidate const &candidate, T const *src, std::uint8_t bps, std::uint16_t const blocksize, EncodeParameters const &param )
+{
+    metrics::timer timer( metrics::stage::PREDICTION );
+    Subframe::Subframe sf;
+    sf.header.type = candidate.type;
+    sf.header.wasted_bits = candidate.wasted_bits;
+    arena::array< T > shifted;
+    if( candidate.wasted_bits != 0 )
+    {
+        shifted = arena::make_array< T >( blocksize );
+        for( std::uint16_t i = 0; i < blocksize; ++i )
+            shifted[ i ] = src[ i ] >> candidate.wasted_bits;
+        src = shifted.get();
+        bps -= candidate.wasted_bits;
+    }
+    switch( candidate.type )
+    {
+    case Subframe::Type::CONSTANT:
+    {
+        Subframe::Constant co;
+        co.value = src[ 0 ];
+        sf.data = co;
+        break;
+    }
+    case Subframe::Type::VERBATIM:
+    {
+        Subframe::Verbatim ver;
+        ver.data = arena::make_array< std::int64_t >( blocksize );
+        std::copy( src, src + blocksize, ver.data.get() );
+        sf.data = std::move( ver );
+        break;
+    }
+    case Subframe::Type::FIXED:
+    {
+        Subframe::Fixed f;
+        f.order = candidate.order;
+        for( std::uint8_t i = 0; i < f.order; ++i )
+            f.warmup[ i ] = src[ i ];
+        f.residual.residual = arena::make_array< std::int64_t >( blocksize - f.order );
+        ComputeFixedResidual( src, f.order, blocksize, f.residual.residual.get() );
+        FindBestResidualParameter( ws, f.residual, f.order, blocksize, param );
+        sf.data = std::move( f );
+        break;
+    }
+    case Subframe::Type::LPC:
+    {
+        Subframe::LPC lpc;
+        lpc.order = candidate.order;
+        for( std::uint8_t i = 0; i < lpc.order; ++i )
+            lpc.warmup[ i ] = src[ i ];
+        lpc.qlp_coeff_precision = candidate.qlp_coeff_precision;
+        lpc.quantization_level = candidate.quantization_level;
+        std::copy( candidate.qlp_coeff, candidate.qlp_coeff + lpc.order, lpc.qlp_coeff );
+        lpc.residual.residual = arena::make_array< std::int64_t >( blocksize - lpc.order );
+        ComputeLPCResidual( src, bps, blocksize, lpc.qlp_coeff, lpc.order, lpc.qlp_coeff_precision, lpc.quantization_level, lpc.residual.residual.get() );
+        FindBestResidualParameter( ws, lpc.residual, lpc.order, blocksize, param );
+        sf.data = std::move( lpc );
+        break;
+    }
+    default:
+        throw exception( "BuildSubframe: unknown subframe type" );
+    }
+    return sf;
+}
+
+template std::uint8_t CountWastedBits( std::int16_t const *, std::uint16_t ) noexcept;
+template std::uint8_t CountWastedBits( std::int32_t const *, std::uint16_t ) noexcept;
+template std::uint8_t CountWastedBits( std::int64_t const *, std::uint16_t ) noexcept;
+template SubframeCandidate EvaluateFixed( EncodeWorkspace &, std::int16_t const *, std::uint8_t, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template SubframeCandidate EvaluateFixed( EncodeWorkspace &, std::int32_t const *, std::uint8_t, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template SubframeCandidate EvaluateFixed( EncodeWorkspace &, std::int64_t const *, std::uint8_t, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template SubframeCandidate EvaluateLPC( EncodeWorkspace &, std::int16_t const *, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template SubframeCandidate EvaluateLPC( EncodeWorkspace &, std::int32_t const *, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template SubframeCandidate EvaluateLPC( EncodeWorkspace &, std::int64_t const *, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template Subframe::Subframe BuildSubframe( EncodeWorkspace &, SubframeCandidate const &, std::int16_t const *, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template Subframe::Subframe BuildSubframe( EncodeWorkspace &, SubframeCandidate const &, std::int32_t const *, std::uint8_t, std::uint16_t, EncodeParameters const & );
+template Subframe::Subframe BuildSubframe( EncodeWorkspace &, SubframeCandidate const &, std::int64_t const *, std::uint8_t, std::uint16_t, EncodeParameters const & );
 
 } // namespace FLAC
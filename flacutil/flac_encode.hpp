@@ -2,15 +2,99 @@
 #define FLACUTIL_FLAC_ENCODE_HPP
 
 #include <cstdint>
+#include <memory>
+#include <vector>
 #include "flac_struct.hpp"
 
 namespace FLAC
 {
 
-std::tuple< Subframe::Constant, std::uint64_t > EncodeConstant( std::int64_t const *src, std::uint8_t bps, std::uint16_t blocksize );
-std::tuple< Subframe::Fixed, std::uint64_t >    EncodeFixed   ( std::int64_t const *src, std::uint8_t bps, std::uint8_t order, std::uint16_t blocksize );
-// std::tuple< Subframe::LPC, std::uint64_t >      EncodeLPC     ( std::int64_t const *src, std::uint8_t bps, ..., std::uint16_t blocksize );
-std::tuple< Subframe::Verbatim, std::uint64_t > EncodeVerbatim( std::int64_t const *src, std::uint8_t bps, std::uint16_t blocksize );
+// LPC apodization windows, applied to the samples before the autocorrelation
+enum class Window : std::uint8_t
+{
+    RECTANGLE,
+    BARTLETT,
+    HANN,
+    WELCH,
+    TUKEY,
+};
+struct Apodization
+{
+    Window type;
+    double p;     // TUKEY: the tapered fraction of the window
+    double start; // the window covers [start, end) of the block (fractions of the blocksize), zero elsewhere
+    double end;
+};
+bool operator==( Apodization const &lhs, Apodization const &rhs ) noexcept;
+
+// search space of the subframe encoders
+struct EncodeParameters
+{
+    std::uint8_t                 max_lpc_order              = 8;     // 0: LPC is not tried
+    bool                         search_qlp_coeff_precision = false; // try every qlp_coeff_precision instead of the default one
+    std::uint8_t                 min_partition_order        = 0;
+    std::uint8_t                 max_partition_order        = 6;
+    std::vector< Apodization >   apodizations               = { { Window::TUKEY, 0.5, 0.0, 1.0 } }; // every window is tried and the cheapest kept
+};
+
+// The functions taking samples are templates on the sample type T,
+// instantiated for std::int16_t, std::int32_t and std::int64_t.
+
+// the number of trailing zero bits shared by all samples (0 if all samples are zero)
+template< typename T >
+std::uint8_t CountWastedBits( T const *src, std::uint16_t blocksize ) noexcept;
+
+struct rice_search_data;
+// Scratch buffers of the cost-only evaluation. They only grow, so one workspace per thread
+// keeps the candidate search free of allocations.
+struct EncodeWorkspace
+{
+    std::uint32_t                         blocksize_capacity;
+    std::uint32_t                         partitions_capacity;
+    std::unique_ptr< std::int64_t[] >     residual;
+    std::unique_ptr< std::uint32_t[] >    zigzag;
+    std::unique_ptr< std::int64_t[] >     fixed_residual; // orders 0 .. MAX_FIXED_ORDER
+    std::unique_ptr< double[] >           windowed;
+    std::unique_ptr< rice_search_data[] > rice_data;
+    struct window_table
+    {
+        Apodization                 apodization;
+        std::uint16_t               blocksize;
+        std::unique_ptr< double[] > data;
+    };
+    std::vector< window_table >           windows;
+
+    EncodeWorkspace();
+    ~EncodeWorkspace();
+    void reserve( std::uint16_t blocksize, std::uint8_t max_partition_order );
+    // the window of blocksize samples, computed on first use and kept for the next blocks
+    double const *window( Apodization const &apodization, std::uint16_t blocksize );
+};
+
+// everything needed to build a subframe again without searching
+struct SubframeCandidate
+{
+    Subframe::Type type;
+    std::uint8_t   wasted_bits;
+    std::uint8_t   order;               // FIXED, LPC
+    std::uint8_t   qlp_coeff_precision; // LPC
+    std::uint8_t   quantization_level;  // LPC
+    std::int16_t   qlp_coeff[ MAX_LPC_ORDER ];
+    std::uint64_t  bits;                // std::numeric_limits< std::uint64_t >::max() if not encodable
+};
+
+// phase one: the size of a candidate in bits (without the subframe header and wasted bits)
+SubframeCandidate EvaluateConstant( std::uint8_t bps, std::uint16_t blocksize );
+// the cheapest of the orders 0 .. max_order (< blocksize)
+template< typename T >
+SubframeCandidate EvaluateFixed   ( EncodeWorkspace &ws, T const *src, std::uint8_t bps, std::uint8_t max_order, std::uint16_t blocksize, EncodeParameters const &param );
+template< typename T >
+SubframeCandidate EvaluateLPC     ( EncodeWorkspace &ws, T const *src, std::uint8_t bps, std::uint16_t blocksize, EncodeParameters const &param );
+SubframeCandidate EvaluateVerbatim( std::uint8_t bps, std::uint16_t blocksize );
+// phase two: build the chosen candidate; src is the unshifted input when candidate.wasted_bits != 0
+// the buffers of the subframe are allocated from the arena of the calling thread
+template< typename T >
+Subframe::Subframe BuildSubframe( EncodeWorkspace &ws, SubframeCandidate const &candidate, T const *src, std::uint8_t bps, std::uint16_t blocksize, EncodeParameters const &param );
 
 } // namespace FLAC
 
@@ -0,0 +1,821 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "arena.hpp"
+#include "buffer.hpp"
+#include "file.hpp"
+#include "flac_encode.hpp"
+#include "flac_encoder.hpp"
+#include "flac_struct.hpp"
+#include "hash.hpp"
+#include "thread_pool.hpp"
+
+namespace FLAC
+{
+
+// Find the cheapest subframe without building any of the candidates.
+template< typename T >
+static
+SubframeCandidate ChooseSubframe( EncodeWorkspace &ws, T const *first_sample, std::uint8_t const bps, std::uint16_t const blocksize, EncodeParameters const &param )
+{
+    if( [&]{
+        for( auto sample = first_sample, last = sample + blocksize; sample < last; ++sample )
+            if( *sample != *first_sample )
+                return false;
+        return true;
+    }() )
+        return EvaluateConstant( bps, blocksize );
+    if( std::uint8_t const wasted = CountWastedBits( first_sample, blocksize ) )
+    {
+        // encode the samples without the shared zero bits; the header costs wasted bits more
+        arena::scope shifted_scope;
+        auto shifted = arena::make_array< T >( blocksize );
+        for( std::uint16_t i = 0; i < blocksize; ++i )
+            shifted[ i ] = first_sample[ i ] >> wasted;
+        auto best = ChooseSubframe( ws, shifted.get(), bps - wasted, blocksize, param );
+        best.wasted_bits = wasted;
+        best.bits += wasted;
+        return best;
+    }
+    auto best = EvaluateVerbatim( bps, blocksize );
+    auto const fixed = EvaluateFixed( ws, first_sample, bps, std::min< int >( MAX_FIXED_ORDER, blocksize - 1 ), blocksize, param );
+    if( fixed.bits < best.bits )
+        best = fixed;
+    if( param.max_lpc_order > 0 )
+    {
+        auto const lpc = EvaluateLPC( ws, first_sample, bps, blocksize, param );
+        if( lpc.bits < best.bits )
+            best = lpc;
+    }
+    return best;
+}
+// the channels (0: left, 1: right, 2: mid, 3: side) coded by each channel assignment
+struct stereo_pair
+{
+    Frame::ChannelAssignment assignment;
+    std::size_t              first;
+    std::size_t              second;
+};
+constexpr std::size_t STEREO_PAIRS_COUNT = 4;
+static constexpr stereo_pair stereo_pairs[ STEREO_PAIRS_COUNT ] = {
+    { Frame::ChannelAssignment::INDEPENDENT, 0, 1 },
+    { Frame::ChannelAssignment::LEFT_SIDE,   0, 3 },
+    { Frame::ChannelAssignment::RIGHT_SIDE,  3, 1 },
+    { Frame::ChannelAssignment::MID_SIDE,    2, 3 },
+};
+// a decorrelated pair is estimated to save at least 1/stereo_estimate_margin of INDEPENDENT
+constexpr unsigned int stereo_estimate_margin = 32;
+// Estimate the bits of each channel from the magnitude of its order 2 fixed residual,
+// all four in one pass, and pick the cheapest pair.
+// return: index in stereo_pairs
+template< typename T >
+static
+std::size_t BestStereoPair( T const *left, T const *right, std::uint8_t const bps, std::uint16_t const blocksize )
+{
+    std::uint64_t sum[ 4 ] = { 0, 0, 0, 0 };
+    if( blocksize > 2 )
+    {
+        std::int64_t l1 = left[ 1 ], l2 = left[ 0 ];
+        std::int64_t r1 = right[ 1 ], r2 = right[ 0 ];
+        for( std::uint16_t i = 2; i < blocksize; ++i )
+        {
+            std::int64_t const l0 = left[ i ], r0 = right[ i ];
+            std::int64_t const l = l0 - 2 * l1 + l2;
+            std::int64_t const r = r0 - 2 * r1 + r2;
+            // the residual of mid is computed from the mid samples, which round differently from (l + r) / 2
+            std::int64_t const m = ((l0 + r0) >> 1) - 2 * ((l1 + r1) >> 1) + ((l2 + r2) >> 1);
+            std::int64_t const s = l - r;
+            sum[ 0 ] += l < 0 ? -l : l;
+            sum[ 1 ] += r < 0 ? -r : r;
+            sum[ 2 ] += m < 0 ? -m : m;
+            sum[ 3 ] += s < 0 ? -s : s;
+            l2 = l1;
+            l1 = l0;
+            r2 = r1;
+            r1 = r0;
+        }
+    }
+    // a rice coded residual with mean magnitude e takes about log2(e) + 1 bits per sample,
+    // and a subframe never more than verbatim; side has one bit more
+    double bits[ 4 ];
+    for( std::size_t ch = 0; ch < 4; ++ch )
+    {
+        double const mean = blocksize > 2 ? static_cast< double >( sum[ ch ] ) / (blocksize - 2) : 0.0;
+        double const per_sample = mean > 1.0 ? std::log2( mean ) + 1.0 : 1.0;
+        bits[ ch ] = blocksize * std::min( per_sample, static_cast< double >( ch == 3 ? bps + 1 : bps ) );
+    }
+    // the fixed residual misjudges channels that LPC predicts well, so a decorrelated pair has to
+    // be cheaper than INDEPENDENT by a margin
+    double const independent_bits = bits[ 0 ] + bits[ 1 ];
+    std::size_t best = 0;
+    double best_bits = independent_bits - independent_bits / stereo_estimate_margin;
+    for( std::size_t i = 1; i < STEREO_PAIRS_COUNT; ++i )
+    {
+        double const pair_bits = bits[ stereo_pairs[ i ].first ] + bits[ stereo_pairs[ i ].second ];
+        if( pair_bits < best_bits )
+        {
+            best = i;
+            best_bits = pair_bits;
+        }
+    }
+    return best;
+}
+// encoding is scheduled in tasks of this many blocks (regions in variable mode)
+constexpr unsigned int frames_per_task = 4;
+// a frame chosen by the cost-only search; BuildFrame makes the frame
+struct frame_plan
+{
+    std::uint64_t            sample;     // index in sd
+    std::uint16_t            blocksize;
+    Frame::ChannelAssignment assignment;
+    SubframeCandidate        subframes[ MAX_CHANNELS ];
+    std::uint64_t            bits;       // with the frame and subframe headers
+};
+// T: the sample type of sd, S: the type of the side channel, which needs one bit more
+template< typename T, typename S >
+static
+void ComputeMidSide( T const *left, T const *right, std::uint16_t const blocksize, T *mid, S *side )
+{
+    for( std::uint16_t i = 0; i < blocksize; ++i )
+    {
+        std::int64_t const l = left[ i ], r = right[ i ];
+        mid[ i ] = static_cast< T >( (l + r) >> 1 );
+        side[ i ] = static_cast< S >( l - r );
+    }
+}
+// The workspace of the calling thread. Channels are evaluated on whichever worker picks them up,
+// and a worker waiting for its channels may run other tasks, which is safe as no workspace
+// buffer is held across a wait.
+static
+EncodeWorkspace &thread_workspace()
+{
+    static thread_local EncodeWorkspace ws;
+    return ws;
+}
+// Run func( 0 ) .. func( count - 1 ); on a worker of a pool they are forked to the pool and joined.
+template< typename Func >
+static
+void ParallelFor( std::size_t const count, Func const &func )
+{
+    thread_pool::pool *const pool = thread_pool::pool::current();
+    if( pool == nullptr || pool->size() < 2 || count < 2 )
+    {
+        for( std::size_t i = 0; i < count; ++i )
+            func( i );
+        return;
+    }
+    std::vector< std::future< void > > forked;
+    for( std::size_t i = 1; i < count; ++i )
+        forked.emplace_back( pool->submit( [ &func, i ]{ func( i ); } ) );
+    // the forked tasks refer to func, so they are waited for even if one of them throws
+    std::exception_ptr error;
+    try
+    {
+        func( 0 );
+    }
+    catch( ... )
+    {
+        error = std::current_exception();
+    }
+    for( auto &&fu : forked )
+        pool->wait( fu );
+    if( error )
+        std::rethrow_exception( error );
+    for( auto &&fu : forked )
+        fu.get();
+}
+// sample: index in sd
+// the channels are evaluated in parallel
+template< typename T, typename S >
+static
+frame_plan ChooseFrame( file::sound_data const &sd, std::uint64_t const sample, std::uint16_t const blocksize, EncoderParameters const &opt )
+{
+    arena::scope mid_side_scope;
+    frame_plan plan;
+    plan.sample = sample;
+    plan.blocksize = blocksize;
+    plan.assignment = Frame::ChannelAssignment::INDEPENDENT;
+    plan.bits = 0;
+    std::size_t const channels = sd.channels();
+    if( channels != 2 || opt.stereo == StereoMode::INDEPENDENT )
+    {
+        ParallelFor( channels, [ & ]( std::size_t const ch ) {
+            plan.subframes[ ch ] = ChooseSubframe( thread_workspace(), file::get_channel< T >( sd, ch ) + sample, sd.bits_per_sample, blocksize, opt.subframe );
+        } );
+        for( std::size_t ch = 0; ch < channels; ++ch )
+            plan.bits += plan.subframes[ ch ].bits;
+    }
+    else
+    {
+        T const *left = file::get_channel< T >( sd, 0 ) + sample;
+        T const *right = file::get_channel< T >( sd, 1 ) + sample;
+        auto mid = arena::make_array< T >( blocksize );
+        auto side = arena::make_array< S >( blocksize );
+        ComputeMidSide( left, right, blocksize, mid.get(), side.get() );
+        // channels: left, right, mid, side
+        auto choose = [ & ]( std::size_t const ch )
+        {
+            EncodeWorkspace &ws = thread_workspace();
+            switch( ch )
+            {
+            case 0:  return ChooseSubframe( ws, left, sd.bits_per_sample, blocksize, opt.subframe );
+            case 1:  return ChooseSubframe( ws, right, sd.bits_per_sample, blocksize, opt.subframe );
+            case 2:  return ChooseSubframe( ws, mid.get(), sd.bits_per_sample, blocksize, opt.subframe );
+            default: return ChooseSubframe( ws, side.get(), sd.bits_per_sample + 1, blocksize, opt.subframe );
+            }
+        };
+        std::size_t const best = opt.stereo == StereoMode::EXHAUSTIVE ? STEREO_PAIRS_COUNT : BestStereoPair( left, right, sd.bits_per_sample, blocksize );
+        std::size_t needed[ 4 ];
+        std::size_t needed_count = 0;
+        for( std::size_t ch = 0; ch < 4; ++ch )
+            if( best == STEREO_PAIRS_COUNT || ch == stereo_pairs[ best ].first || ch == stereo_pairs[ best ].second )
+                needed[ needed_count++ ] = ch;
+        SubframeCandidate subframes[ 4 ];
+        ParallelFor( needed_count, [ & ]( std::size_t const i ) {
+            subframes[ needed[ i ] ] = choose( needed[ i ] );
+        } );
+        std::size_t chosen = best;
+        if( chosen == STEREO_PAIRS_COUNT )
+        {
+            plan.bits = std::numeric_limits< decltype( plan.bits ) >::max();
+            for( std::size_t i = 0; i < STEREO_PAIRS_COUNT; ++i )
+            {
+                std::uint64_t const pair_bits = subframes[ stereo_pairs[ i ].first ].bits + subframes[ stereo_pairs[ i ].second ].bits;
+                if( pair_bits < plan.bits )
+                {
+                    chosen = i;
+                    plan.bits = pair_bits;
+                }
+            }
+        }
+        else
+            plan.bits = subframes[ stereo_pairs[ chosen ].first ].bits + subframes[ stereo_pairs[ chosen ].second ].bits;
+        plan.assignment = stereo_pairs[ chosen ].assignment;
+        plan.subframes[ 0 ] = subframes[ stereo_pairs[ chosen ].first ];
+        plan.subframes[ 1 ] = subframes[ stereo_pairs[ chosen ].second ];
+    }
+    // subframe headers, frame header (with a 2 byte coded number) and footer
+    plan.bits += 8 * channels + 8 * (4 + 2 + 1 + 2);
+    return plan;
+}
+// position: sample number of the first sample of sd in the stream
+// the frame is valid until the arena::scope of the caller closes
+template< typename T, typename S >
+static
+Frame::Frame BuildFrame( EncodeWorkspace &ws, file::sound_data const &sd, frame_plan const &plan, std::uint64_t const position, EncoderParameters const &opt )
+{
+    Frame::Frame f;
+    f.header.blocksize = plan.blocksize;
+    f.header.sample_rate = sd.sample_rate;
+    f.header.channels = sd.channels();
+    f.header.channel_assignment = plan.assignment;
+    f.header.bits_per_sample = sd.bits_per_sample;
+    f.header.number_type = Frame::NumberType::SAMPLE_NUMBER;
+    f.header.number.sample_number = position + plan.sample;
+    if( plan.assignment == Frame::ChannelAssignment::INDEPENDENT )
+    {
+        for( std::size_t ch = 0; ch < sd.channels(); ++ch )
+            f.subframes[ ch ] = BuildSubframe( ws, plan.subframes[ ch ], file::get_channel< T >( sd, ch ) + plan.sample, sd.bits_per_sample, plan.blocksize, opt.subframe );
+        return f;
+    }
+    T const *left = file::get_channel< T >( sd, 0 ) + plan.sample;
+    T const *right = file::get_channel< T >( sd, 1 ) + plan.sample;
+    auto mid = arena::make_array< T >( plan.blocksize );
+    auto side = arena::make_array< S >( plan.blocksize );
+    ComputeMidSide( left, right, plan.blocksize, mid.get(), side.get() );
+    auto build = [ & ]( SubframeCandidate const &candidate, std::size_t const ch )
+    {
+        switch( ch )
+        {
+        case 0:  return BuildSubframe( ws, candidate, left, sd.bits_per_sample, plan.blocksize, opt.subframe );
+        case 1:  return BuildSubframe( ws, candidate, right, sd.bits_per_sample, plan.blocksize, opt.subframe );
+        case 2:  return BuildSubframe( ws, candidate, mid.get(), sd.bits_per_sample, plan.blocksize, opt.subframe );
+        default: return BuildSubframe( ws, candidate, side.get(), sd.bits_per_sample + 1, plan.blocksize, opt.subframe );
+        }
+    };
+    stereo_pair const &pair = stereo_pairs[ static_cast< std::size_t >( plan.assignment ) ];
+    f.subframes[ 0 ] = build( plan.subframes[ 0 ], pair.first );
+    f.subframes[ 1 ] = build( plan.subframes[ 1 ], pair.second );
+    return f;
+}
+// Plan [sample, sample + length) as one frame and as two halves (recursively), and keep the cheaper.
+// return: frames, bits
+template< typename T, typename S >
+static
+std::tuple< std::vector< frame_plan >, std::uint64_t > SearchBlocksize( file::sound_data const &sd, std::uint64_t const sample, std::uint32_t const length, EncoderParameters const &opt )
+{
+    std::vector< frame_plan > plans( 1, ChooseFrame< T, S >( sd, sample, length, opt ) );
+    std::uint64_t const bits = plans[ 0 ].bits;
+    std::uint32_t const half = length / 2;
+    if( half < opt.min_blocksize )
+        return std::make_tuple( std::move( plans ), bits );
+    auto first = SearchBlocksize< T, S >( sd, sample, half, opt );
+    auto second = SearchBlocksize< T, S >( sd, sample + half, length - half, opt );
+    std::uint64_t const split_bits = std::get< 1 >( first ) + std::get< 1 >( second );
+    if( split_bits >= bits )
+        return std::make_tuple( std::move( plans ), bits );
+    std::get< 0 >( first ).insert( std::get< 0 >( first ).end(), std::get< 0 >( second ).begin(), std::get< 0 >( second ).end() );
+    return std::make_tuple( std::move( std::get< 0 >( first ) ), split_bits );
+}
+// bytestream, min_framesize, max_framesize, frames
+// frames: the first sample, the offset in the bytestream and the blocksize of every frame
+using encoded_part = std::tuple< buffer::bytestream<>, std::uint32_t, std::uint32_t, std::vector< MetaData::SeekPoint > >;
+// encode the whole sd, which starts at sample number position
+template< typename T, typename S >
+static
+encoded_part EncodePartialImpl( file::sound_data const &sd, std::uint64_t const position, EncoderParameters const &opt, std::atomic< std::uint64_t > &encoded )
+{
+    std::uint64_t const last_sample = sd.samples;
+    buffer::bytestream<> fbs;
+    std::uint32_t min_framesize = std::numeric_limits< decltype( min_framesize ) >::max();
+    std::uint32_t max_framesize = 0;
+    std::vector< MetaData::SeekPoint > frames;
+    // no frame the encoder writes is larger than a verbatim one, so the bytestream never grows;
+    // the pages beyond the encoded size are not touched
+    std::size_t const channels = sd.channels();
+    std::size_t const max_frames = last_sample / (opt.variable_blocksize ? opt.min_blocksize : opt.blocksize) + 1;
+    fbs.reserve( last_sample * channels * (sd.bits_per_sample + 1) / 8 + max_frames * (16 + 2 + 8 * channels) );
+    auto write_frame = [ & ]( Frame::Frame const &f )
+    {
+        std::size_t const pos = fbs.get_position();
+        std::uint64_t const first_sample = f.header.number_type == Frame::NumberType::SAMPLE_NUMBER ? f.header.number.sample_number : static_cast< std::uint64_t >( f.header.number.frame_number ) * opt.blocksize;
+        frames.push_back( { first_sample, pos, f.header.blocksize } );
+        WriteFrame( fbs, f );
+        std::uint32_t const framesize = fbs.get_position() - pos;
+        min_framesize = std::min( min_framesize, framesize );
+        max_framesize = std::max( max_framesize, framesize );
+    };
+    EncodeWorkspace &ws = thread_workspace();
+    std::uint16_t const blocksize = opt.blocksize;
+    for( std::uint64_t sample = 0; sample < last_sample; sample += blocksize )
+    {
+        std::uint16_t const this_blocksize = sample + blocksize > last_sample ? last_sample - sample : blocksize;
+        if( opt.variable_blocksize )
+        {
+            auto const plans = std::get< 0 >( SearchBlocksize< T, S >( sd, sample, this_blocksize, opt ) );
+            for( auto &&plan : plans )
+            {
+                arena::scope frame_scope;
+                write_frame( BuildFrame< T, S >( ws, sd, plan, position, opt ) );
+            }
+        }
+        else
+        {
+            arena::scope frame_scope;
+            auto f = BuildFrame< T, S >( ws, sd, ChooseFrame< T, S >( sd, sample, this_blocksize, opt ), position, opt );
+            f.header.number_type = Frame::NumberType::FRAME_NUMBER;
+            f.header.number.frame_number = (position + sample) / blocksize;
+            write_frame( f );
+        }
+        encoded += this_blocksize;
+    }
+    return std::make_tuple( std::move( fbs ), min_framesize, max_framesize, std::move( frames ) );
+}
+// side channels of 32 bps input need 33 bits
+static
+encoded_part EncodePartial( file::sound_data const &sd, std::uint64_t const position, EncoderParameters const &opt, std::atomic< std::uint64_t > &encoded )
+{
+    if( sd.bits_per_sample <= 16 )
+        return EncodePartialImpl< std::int16_t, std::int32_t >( sd, position, opt, encoded );
+    if( sd.bits_per_sample < 32 )
+        return EncodePartialImpl< std::int32_t, std::int32_t >( sd, position, opt, encoded );
+    return EncodePartialImpl< std::int32_t, std::int64_t >( sd, position, opt, encoded );
+}
+
+// the interleaved little endian bytes of sd the STREAMINFO MD5 is computed from
+static
+buffer::buffer PcmBytes( file::sound_data const &sd )
+{
+    std::size_t const bytes = (sd.bits_per_sample + 7) / 8;
+    std::size_t const channels = sd.channels();
+    std::size_t const size = sd.samples * channels * bytes;
+    auto data = std::make_unique< std::uint8_t[] >( size );
+    std::uint8_t *p = data.get();
+    auto interleave = [ & ]( auto const &wave )
+    {
+        for( std::uint64_t i = 0; i < sd.samples; ++i )
+            for( std::size_t ch = 0; ch < channels; ++ch )
+            {
+                std::uint32_t const v = static_cast< std::uint32_t >( wave[ ch ][ i ] );
+                for( std::size_t b = 0; b < bytes; ++b )
+                    *p++ = static_cast< std::uint8_t >( v >> (8 * b) );
+            }
+    };
+    if( sd.bits_per_sample <= 16 )
+        interleave( sd.wave16 );
+    else
+        interleave( sd.wave32 );
+    return buffer::buffer( std::move( data ), size );
+}
+
+struct Encoder::state
+{
+    StreamFormat const                        format;
+    EncoderParameters const                   param;
+    frame_sink const                          sink;
+    progress_callback                         progress;
+    std::unique_ptr< thread_pool::pool >      own_pool;
+    thread_pool::pool                        *pool;
+    std::uint64_t const                       chunk_samples;
+    // at most max_inflight chunks are held at a time, so the memory usage does not depend on the length of the input
+    std::size_t const                         max_inflight;
+    std::deque< std::future< encoded_part > > inflight;
+    std::unique_ptr< MD5Pipeline >            own_md5;
+    MD5Pipeline                              *md5 = nullptr;
+    MD5Pipeline::stream_id                    md5_stream = 0; // open while md5 is not null
+    std::atomic< std::uint64_t >              encoded;
+    std::uint64_t                             submitted = 0; // samples per channel
+    file::sound_data                          staging;       // samples waiting for a whole chunk
+    MetaData::StreamInfo                      si;
+    MetaData::SeekTable                       st;
+    std::uint64_t                             seek_interval;
+    std::uint64_t                             seek_targets;
+    std::uint64_t                             frames_offset = 0;  // of the next part, from the first frame
+    std::size_t                               seek_filled = 0;    // the seek points set
+    std::uint64_t                             seek_target = 0;    // the next interval to find the frame of
+    std::uint16_t                             last_blocksize = 0; // min_blocksize does not count the last frame of the stream
+    bool                                      finished = false;
+
+    state( StreamFormat const &format, EncoderParameters const &param, frame_sink sink, thread_pool::pool *shared_pool, MD5Pipeline *shared_md5 )
+        : format( format )
+        , param( param )
+        , sink( std::move( sink ) )
+        , own_pool( shared_pool ? nullptr : std::make_unique< thread_pool::pool >( param.threads ) )
+        , pool( shared_pool ? shared_pool : own_pool.get() )
+        , chunk_samples( static_cast< std::uint64_t >( param.blocksize ) * frames_per_task )
+        , max_inflight( 2 * pool->size() + 1 )
+        , encoded( 0 )
+    {
+        if( format.channels == 0 || format.channels > MAX_CHANNELS || format.bits_per_sample < 4 || format.bits_per_sample > 32 )
+            throw exception( "Encoder: unsupported format" );
+        if( param.md5 )
+        {
+            if( !shared_md5 )
+                own_md5 = std::make_unique< MD5Pipeline >();
+            md5 = shared_md5 ? shared_md5 : own_md5.get();
+            md5_stream = md5->open( max_inflight );
+        }
+        reset_staging();
+        si.min_blocksize = std::numeric_limits< decltype( si.min_blocksize ) >::max();
+        si.max_blocksize = 0;
+        si.min_framesize = std::numeric_limits< decltype( si.min_framesize ) >::max();
+        si.max_framesize = 0;
+        si.sample_rate = format.sample_rate;
+        si.channels = format.channels;
+        si.bits_per_sample = format.bits_per_sample;
+        si.total_sample = format.total_samples;
+        std::memset( si.md5sum, 0, sizeof( si.md5sum ) );
+        // one point per interval, all placeholders until the frames are written; the number of
+        // points is fixed up front, so that the table keeps its size
+        seek_interval = param.seek_in_seconds ? param.seek_interval * format.sample_rate : param.seek_interval;
+        seek_targets = seek_interval != 0 && format.total_samples != 0 ? (format.total_samples - 1) / seek_interval + 1 : 0;
+        if( seek_targets != 0 )
+        {
+            // no more points than frames: only the last frame may be shorter than the smallest blocksize
+            std::uint64_t const max_frames = format.total_samples / (param.variable_blocksize ? param.min_blocksize : param.blocksize) + 1;
+            std::uint64_t const points = std::min( seek_targets, max_frames );
+            if( points * SEEKPOINT_LENGTH >= (1u << 24) )
+                throw exception( "Encoder: too many seek points" );
+            st.points.assign( points, { PLACEHOLDER_SEEKPOINT, 0, 0 } );
+        }
+    }
+    void reset_staging()
+    {
+        staging = file::sound_data();
+        staging.bits_per_sample = format.bits_per_sample;
+        staging.samples = 0;
+        staging.sample_rate = format.sample_rate;
+    }
+    // the STREAMINFO statistics and the seek points of a part, in stream order
+    void add_part( encoded_part const &encdata )
+    {
+        si.min_framesize = std::min( std::get< 1 >( encdata ), si.min_framesize );
+        si.max_framesize = std::max( std::get< 2 >( encdata ), si.max_framesize );
+        for( auto &&frame : std::get< 3 >( encdata ) )
+        {
+            if( last_blocksize != 0 )
+                si.min_blocksize = std::min( last_blocksize, si.min_blocksize );
+            last_blocksize = frame.frame_samples;
+            si.max_blocksize = std::max( frame.frame_samples, si.max_blocksize );
+            // the point of every interval is the frame holding its first sample; an interval
+            // starting in the frame of the previous one leaves a placeholder at the end
+            if( seek_target >= seek_targets || seek_target * seek_interval >= frame.sample_number + frame.frame_samples )
+                continue;
+            st.points[ seek_filled++ ] = { frame.sample_number, frames_offset + frame.stream_offset, frame.frame_samples };
+            seek_target = (frame.sample_number + frame.frame_samples - 1) / seek_interval + 1;
+        }
+        frames_offset += std::get< 0 >( encdata ).get_position();
+    }
+    // hand the front part and the finished parts behind it to the sink in one call,
+    // straight from their bytestreams
+    void write_front()
+    {
+        while( inflight.front().wait_for( std::chrono::seconds( 1 ) ) != std::future_status::ready )
+            if( progress )
+                progress( encoded.load() );
+        std::vector< encoded_part > parts;
+        do
+        {
+            parts.emplace_back( inflight.front().get() );
+            inflight.pop_front();
+        }
+        while( !inflight.empty() && inflight.front().wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready );
+        std::vector< std::uint8_t const * > data;
+        std::vector< std::size_t > sizes;
+        for( auto &&encdata : parts )
+        {
+            add_part( encdata );
+            data.push_back( std::get< 0 >( encdata ).data() );
+            sizes.push_back( std::get< 0 >( encdata ).get_position() );
+        }
+        sink( data.data(), sizes.data(), parts.size() );
+    }
+    void submit( file::sound_data chunk, buffer::buffer pcm )
+    {
+        if( inflight.size() >= max_inflight )
+            write_front();
+        if( md5 )
+            md5->push( md5_stream, pcm.get_size() != 0 ? std::move( pcm ) : PcmBytes( chunk ) );
+        std::uint64_t const position = submitted;
+        submitted += chunk.samples;
+        inflight.emplace_back( pool->submit( [ this, chunk = std::move( chunk ), position ]{ return EncodePartial( chunk, position, param, encoded ); } ) );
+    }
+    // copy samples into staging and submit every chunk filled; get( ch, i ): sample i of channel ch
+    template< typename Get >
+    void stage( std::uint64_t const samples, Get const &get )
+    {
+        auto fill = [ & ]( auto &wave, std::uint64_t const first, std::uint64_t const n )
+        {
+            using sample_type = typename std::remove_reference_t< decltype( wave ) >::value_type::element_type;
+            if( wave.empty() )
+                for( std::size_t ch = 0; ch < format.channels; ++ch )
+                    wave.emplace_back( std::make_unique< sample_type[] >( chunk_samples ) );
+            for( std::size_t ch = 0; ch < format.channels; ++ch )
+                for( std::uint64_t i = 0; i < n; ++i )
+                    wave[ ch ][ staging.samples + i ] = static_cast< sample_type >( get( ch, first + i ) );
+        };
+        for( std::uint64_t done = 0; done < samples; )
+        {
+            std::uint64_t const n = std::min( samples - done, chunk_samples - staging.samples );
+            if( format.bits_per_sample <= 16 )
+                fill( staging.wave16, done, n );
+            else
+                fill( staging.wave32, done, n );
+            staging.samples += n;
+            done += n;
+            if( staging.samples == chunk_samples )
+            {
+                submit( std::move( staging ), buffer::buffer() );
+                reset_staging();
+            }
+        }
+    }
+    void check_push() const
+    {
+        if( finished )
+            throw exception( "Encoder::push: already finished" );
+    }
+};
+
+Encoder::Encoder( StreamFormat const &format, EncoderParameters const &param, frame_sink sink, thread_pool::pool *const pool, MD5Pipeline *const md5 )
+    : s( std::make_unique< state >( format, param, std::move( sink ), pool, md5 ) )
+{
+}
+Encoder::~Encoder()
+{
+    // the tasks refer to the state
+    for( auto &&fu : s->inflight )
+        fu.wait();
+    // a shared pipeline outlives the encoder
+    if( s->md5 )
+        s->md5->close( s->md5_stream );
+}
+void Encoder::set_progress( progress_callback callback )
+{
+    s->progress = std::move( callback );
+}
+std::uint64_t Encoder::get_chunk_samples() const noexcept
+{
+    return s->chunk_samples;
+}
+void Encoder::push( file::sound_data chunk, buffer::buffer pcm )
+{
+    s->check_push();
+    if( chunk.channels() != s->format.channels || chunk.bits_per_sample != s->format.bits_per_sample )
+        throw exception( "Encoder::push: the chunk does not match the format" );
+    if( chunk.samples == 0 )
+        return;
+    // every frame but the last one of the stream must be whole, so a chunk is taken over as is
+    // only if it ends at a frame boundary or at the end of the stream
+    bool const whole = chunk.samples % s->param.blocksize == 0 || s->submitted + chunk.samples == s->format.total_samples;
+    if( s->staging.samples == 0 && chunk.samples <= s->chunk_samples && whole )
+    {
+        s->submit( std::move( chunk ), std::move( pcm ) );
+        return;
+    }
+    auto const stage = [ & ]( auto const &wave ) {
+        s->stage( chunk.samples, [ & ]( std::size_t const ch, std::uint64_t const i ) { return wave[ ch ][ i ]; } );
+    };
+    if( chunk.bits_per_sample <= 16 )
+        stage( chunk.wave16 );
+    else
+        stage( chunk.wave32 );
+}
+template< typename T >
+void Encoder::push_interleaved( T const *const samples, std::uint64_t const samples_per_channel )
+{
+    s->check_push();
+    std::size_t const channels = s->format.channels;
+    s->stage( samples_per_channel, [ & ]( std::size_t const ch, std::uint64_t const i ) { return samples[ i * channels + ch ]; } );
+}
+template< typename T >
+void Encoder::push_planar( T const *const *const channels, std::uint64_t const samples )
+{
+    s->check_push();
+    s->stage( samples, [ & ]( std::size_t const ch, std::uint64_t const i ) { return channels[ ch ][ i ]; } );
+}
+template void Encoder::push_interleaved< std::int16_t >( std::int16_t const *, std::uint64_t );
+template void Encoder::push_interleaved< std::int32_t >( std::int32_t const *, std::uint64_t );
+template void Encoder::push_planar< std::int16_t >( std::int16_t const *const *, std::uint64_t );
+template void Encoder::push_planar< std::int32_t >( std::int32_t const *const *, std::uint64_t );
+void Encoder::finish()
+{
+    if( s->finished )
+        return;
+    if( s->staging.samples != 0 )
+    {
+        s->submit( std::move( s->staging ), buffer::buffer() );
+        s->reset_staging();
+    }
+    while( !s->inflight.empty() )
+        s->write_front();
+    if( s->md5 )
+    {
+        auto const digest = s->md5->close( s->md5_stream );
+        s->md5 = nullptr;
+        std::copy( digest.begin(), digest.end(), s->si.md5sum );
+    }
+    if( s->format.total_samples != 0 && s->submitted != s->format.total_samples )
+        throw exception( "Encoder::finish: the number of samples differs from total_samples" );
+    MetaData::StreamInfo &si = s->si;
+    si.total_sample = s->submitted;
+    if( !s->param.variable_blocksize )
+        si.min_blocksize = si.max_blocksize = s->param.blocksize;
+    else if( si.min_blocksize > si.max_blocksize ) // only one frame
+        si.min_blocksize = si.max_blocksize;
+    if( si.min_framesize > si.max_framesize ) // no frame
+        si.min_framesize = si.max_framesize = 0;
+    s->finished = true;
+}
+buffer::bytestream<> Encoder::metadata() const
+{
+    buffer::bytestream<> mdbs;
+    mdbs.put_bytes( STREAM_SYNC_STRING, 4 );
+    MetaData::Metadata md;
+    md.type = MetaData::Type::STREAMINFO;
+    md.is_last = s->st.points.empty();
+    md.length = STREAMINFO_LENGTH;
+    md.data = s->si;
+    if( !s->finished )
+    {
+        // the placeholder stays when the output cannot be rewritten: the blocksizes as configured, frame sizes unknown
+        MetaData::StreamInfo si = s->si;
+        si.min_blocksize = s->param.variable_blocksize ? s->param.min_blocksize : s->param.blocksize;
+        si.max_blocksize = s->param.blocksize;
+        si.min_framesize = si.max_framesize = 0;
+        md.data = si;
+    }
+    WriteMetadata( mdbs, md );
+    if( !s->st.points.empty() )
+    {
+        md.type = MetaData::Type::SEEKTABLE;
+        md.is_last = true;
+        md.length = SEEKPOINT_LENGTH * s->st.points.size();
+        md.data = s->st;
+        WriteMetadata( mdbs, md );
+    }
+    return mdbs;
+}
+MetaData::StreamInfo const &Encoder::get_streaminfo() const noexcept
+{
+    return s->si;
+}
+MetaData::SeekTable const &Encoder::get_seektable() const noexcept
+{
+    return s->st;
+}
+
+MD5Pipeline::MD5Pipeline()
+    : next_id( 0 )
+    , stopping( false )
+    , thread( [ this ]{ run(); } )
+{
+}
+MD5Pipeline::~MD5Pipeline()
+{
+    {
+        std::lock_guard< std::mutex > lg( mutex );
+        stopping = true;
+    }
+    cond.notify_all();
+    thread.join();
+}
+void MD5Pipeline::run()
+{
+    std::vector< stream * >             batch;
+    std::vector< buffer::buffer >       chunks;
+    std::vector< hash::md5_hash * >     hashes;
+    std::vector< std::uint8_t const * > data;
+    std::vector< std::size_t >          sizes;
+    auto const queued = [ & ]{
+        for( auto &&st : streams )
+            if( !st.second.queue.empty() )
+                return true;
+        return false;
+    };
+    while( true )
+    {
+        batch.clear();
+        chunks.clear();
+        {
+            std::unique_lock< std::mutex > ul( mutex );
+            cond.wait( ul, [ & ]{ return stopping || queued(); } );
+            // the front chunk of every stream; the next chunk of a stream waits for this one
+            for( auto &&st : streams )
+            {
+                if( st.second.queue.empty() )
+                    continue;
+                st.second.hashing = true;
+                batch.push_back( &st.second );
+                chunks.emplace_back( std::move( st.second.queue.front() ) );
+                st.second.queue.pop_front();
+            }
+            if( batch.empty() )
+                return;
+        }
+        cond.notify_all();
+        hashes.clear();
+        data.clear();
+        sizes.clear();
+        for( std::size_t i = 0; i < batch.size(); ++i )
+        {
+            hashes.push_back( &batch[ i ]->md5 );
+            data.push_back( chunks[ i ].get() );
+            sizes.push_back( chunks[ i ].get_size() );
+        }
+        hash::md5_update( hashes.data(), data.data(), sizes.data(), batch.size() );
+        {
+            std::lock_guard< std::mutex > lg( mutex );
+            for( auto &&st : batch )
+                st->hashing = false;
+        }
+        cond.notify_all();
+    }
+}
+MD5Pipeline::stream_id MD5Pipeline::open( std::size_t const max_queued )
+{
+    std::lock_guard< std::mutex > lg( mutex );
+    stream_id const id = next_id++;
+    streams[ id ].max_queued = max_queued;
+    return id;
+}
+void MD5Pipeline::push( stream_id const id, buffer::buffer pcm )
+{
+    {
+        std::unique_lock< std::mutex > ul( mutex );
+        stream &st = streams.at( id );
+        cond.wait( ul, [ & ]{ return st.queue.size() < st.max_queued; } );
+        st.queue.emplace_back( std::move( pcm ) );
+    }
+    cond.notify_all();
+}
+std::array< std::uint8_t, 16 > MD5Pipeline::close( stream_id const id )
+{
+    std::unique_lock< std::mutex > ul( mutex );
+    auto const it = streams.find( id );
+    cond.wait( ul, [ & ]{ return it->second.queue.empty() && !it->second.hashing; } );
+    auto const digest = it->second.md5.get();
+    streams.erase( it );
+    return digest;
+}
+
+} // namespace FLAC
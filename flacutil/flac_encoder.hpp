@@ -0,0 +1,133 @@
+#ifndef FLACUTIL_FLAC_ENCODER_HPP
+#define FLACUTIL_FLAC_ENCODER_HPP
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "buffer.hpp"
+#include "file.hpp"
+#include "flac_encode.hpp"
+#include "flac_struct.hpp"
+#include "hash.hpp"
+#include "thread_pool.hpp"
+
+namespace FLAC
+{
+
+enum class StereoMode : std::uint8_t
+{
+    INDEPENDENT, // never decorrelate
+    ESTIMATE,    // encode only the channel assignment the residual estimate favours
+    EXHAUSTIVE,  // encode left, right, mid and side and keep the cheapest pair
+};
+struct EncoderParameters
+{
+    std::uint16_t    blocksize          = 4096;  // fixed blocksize, or the biggest blocksize tried in variable mode
+    std::uint16_t    min_blocksize      = 1024;  // the smallest blocksize tried in variable mode
+    bool             variable_blocksize = false;
+    StereoMode       stereo             = StereoMode::ESTIMATE;
+    EncodeParameters subframe;
+    unsigned int     threads            = 0;     // of the pool of the encoder when none is given, 0: std::thread::hardware_concurrency()
+    bool             md5                = true;  // compute the MD5 of the input for STREAMINFO
+    std::uint64_t    seek_interval      = 10;    // the distance of the seek points, 0: no SEEKTABLE
+    bool             seek_in_seconds    = true;  // seek_interval is in seconds, not in samples
+};
+struct StreamFormat
+{
+    std::uint32_t sample_rate;
+    std::uint8_t  channels;
+    std::uint8_t  bits_per_sample;
+    std::uint64_t total_samples; // 0: unknown, then there is no SEEKTABLE
+};
+
+// Hashes the PCM of any number of streams on one thread while the pool encodes them.
+// The chunks of a stream are hashed in the order they are pushed; the front chunks of all
+// the streams are hashed side by side with hash::md5_update.
+class MD5Pipeline
+{
+public:
+    using stream_id = std::size_t;
+
+    MD5Pipeline();
+    MD5Pipeline( MD5Pipeline const & ) = delete;
+    MD5Pipeline &operator=( MD5Pipeline const & ) = delete;
+    ~MD5Pipeline();
+
+    // max_queued: push waits while this many chunks of the stream are not hashed yet
+    stream_id open( std::size_t max_queued );
+    void push( stream_id id, buffer::buffer pcm );
+    // wait for the chunks of the stream and forget it
+    std::array< std::uint8_t, 16 > close( stream_id id );
+
+private:
+    struct stream
+    {
+        hash::md5_hash               md5;
+        std::deque< buffer::buffer > queue;
+        std::size_t                  max_queued = 0;
+        bool                         hashing = false; // the front chunk is being hashed
+    };
+    std::mutex                    mutex;
+    std::condition_variable       cond;
+    std::map< stream_id, stream > streams;
+    stream_id                     next_id;
+    bool                          stopping;
+    std::thread                   thread;
+
+    void run();
+};
+
+// Streaming encoder: samples are pushed in, encoded on a thread pool, and the frames come out
+// of the sink in stream order, from the thread that pushes.
+// The metadata is known only after finish(); write metadata() before the frames as a
+// placeholder and overwrite it afterwards, it keeps its size; the placeholder is a valid
+// header without MD5 and frame sizes where the output cannot be rewritten.
+class Encoder
+{
+public:
+    // count buffers holding consecutive frames, valid only during the call
+    using frame_sink = std::function< void( std::uint8_t const *const *data, std::size_t const *sizes, std::size_t count ) >;
+    // the samples per channel encoded so far; called about once a second while the encoder waits for frames
+    using progress_callback = std::function< void( std::uint64_t samples ) >;
+
+    // pool: shared with other encoders; if null, the encoder starts a pool of param.threads threads
+    // md5: shared with other encoders; if null and param.md5 is set, the encoder starts its own
+    Encoder( StreamFormat const &format, EncoderParameters const &param, frame_sink sink, thread_pool::pool *pool = nullptr, MD5Pipeline *md5 = nullptr );
+    Encoder( Encoder const & ) = delete;
+    Encoder &operator=( Encoder const & ) = delete;
+    ~Encoder();
+
+    void set_progress( progress_callback callback );
+    // chunks of this many samples (and a shorter last one) are encoded without being copied
+    std::uint64_t get_chunk_samples() const noexcept;
+    // planar samples in the layout of file::sound_data, taken over
+    // pcm: the interleaved little endian bytes of chunk for the MD5, if at hand; computed from chunk if empty
+    void push( file::sound_data chunk, buffer::buffer pcm = buffer::buffer() );
+    // T: std::int16_t or std::int32_t
+    template< typename T >
+    void push_interleaved( T const *samples, std::uint64_t samples_per_channel );
+    template< typename T >
+    void push_planar( T const *const *channels, std::uint64_t samples );
+    // encode the rest and wait for every frame; STREAMINFO and SEEKTABLE are complete afterwards
+    void finish();
+
+    // "fLaC", STREAMINFO and SEEKTABLE
+    buffer::bytestream<> metadata() const;
+    MetaData::StreamInfo const &get_streaminfo() const noexcept;
+    MetaData::SeekTable const &get_seektable() const noexcept;
+
+private:
+    struct state;
+    std::unique_ptr< state > s;
+};
+
+} // namespace FLAC
+
+#endif // FLACUTIL_FLAC_ENCODER_HPP
@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 
+#include "arena.hpp"
 #include "variant.hpp"
 
 
@@ -50,7 +51,11 @@ constexpr std::uint8_t  MAX_FIXED_ORDER         = 4;
 constexpr std::uint16_t FRAME_HEADER_SYNC       = 0x3ffe;
 
 constexpr std::uint32_t STREAMINFO_LENGTH       = 34;
+constexpr std::uint32_t SEEKPOINT_LENGTH        = 18;
+constexpr std::uint64_t PLACEHOLDER_SEEKPOINT   = 0xffffffffffffffff; // sample_number of a placeholder point
 
+// The sample buffers of a subframe come from the arena of the thread that built or read it,
+// so a frame is valid until the arena::scope around it closes.
 namespace Subframe
 {
     enum class EntropyCodingMethodType : std::uint8_t
@@ -67,17 +72,17 @@ namespace Subframe
     };
     struct PartitionedRice
     {
-        std::uint8_t                      order;
-        std::unique_ptr< std::uint8_t[] > parameters;
-        std::unique_ptr< bool[] >         is_raw_bits;
+        std::uint8_t                  order;
+        arena::array< std::uint8_t >  parameters;
+        arena::array< bool >          is_raw_bits;
     };
     struct Residual
     {
-        EntropyCodingMethodType           type;
+        EntropyCodingMethodType       type;
         variant<
             PartitionedRice
-        >                                 data;
-        std::unique_ptr< std::int64_t[] > residual;
+        >                             data;
+        arena::array< std::int64_t >  residual;
     };
     struct Constant
     {
@@ -85,7 +90,7 @@ namespace Subframe
     };
     struct Verbatim
     {
-        std::unique_ptr< std::int64_t[] > data;
+        arena::array< std::int64_t > data;
     };
     struct Fixed
     {
@@ -194,7 +199,7 @@ namespace MetaData
     struct SeekPoint
     {
         std::uint64_t sample_number;
-        std::uint64_t stream_offset;
+        std::uint64_t stream_offset; // from the first byte of the first frame header
         std::uint16_t frame_samples;
     };
     struct SeekTable
@@ -293,6 +298,7 @@ void WriteFrame   ( buffer::bytestream<> &bs, Frame::Frame const &f );
 void WriteMetadata( buffer::bytestream<> &bs, MetaData::Metadata const &md );
 //// print.cpp
 void PrintStreamInfo      ( FLAC::MetaData::StreamInfo const &si );
+void PrintSeekTable       ( FLAC::MetaData::SeekTable const &st );
 void PrintFrameHeader     ( FLAC::Frame::Header const &fh );
 void PrintFrameFooter     ( FLAC::Frame::Footer const &ff );
 void PrintSubframeHeader  ( FLAC::Subframe::Header const &sfh );
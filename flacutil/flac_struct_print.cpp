@@ -23,6 +23,18 @@ void PrintStreamInfo( FLAC::MetaData::StreamInfo const &si )
         std::cout << std::hex << std::setw( 2 ) << std::setfill( '0' ) << (int)si.md5sum[ i ];
     std::cout << std::endl;
 }
+void PrintSeekTable( FLAC::MetaData::SeekTable const &st )
+{
+    std::cout << "SeekTable" << std::endl;
+    std::cout << std::dec;
+    for( auto &&p : st.points )
+    {
+        if( p.sample_number == FLAC::PLACEHOLDER_SEEKPOINT )
+            std::cout << "  placeholder" << std::endl;
+        else
+            std::cout << "  sample_number = " << p.sample_number << ", stream_offset = " << p.stream_offset << ", frame_samples = " << p.frame_samples << std::endl;
+    }
+}
 void PrintFrameHeader( FLAC::Frame::Header const &fh )
 {
     std::cout << "Frame::Header" << std::endl;
@@ -2,9 +2,11 @@
 #include <iostream>
 #include <tuple>
 #include <utility>
+#include "arena.hpp"
 #include "buffer.hpp"
 #include "flac_struct.hpp"
 #include "hash.hpp"
+#include "metrics.hpp"
 #include "utility.hpp"
 
 #define SHOW(op) do{ std::cout << __func__ << ":L." << __LINE__ << ": " << #op << " = " << static_cast< std::intmax_t >( op ) << std::endl; }while( false )
@@ -16,20 +18,20 @@ namespace FLAC
 
 template< std::uint8_t PARAMETER_LEN, typename BitStream >
 static
-std::tuple< std::unique_ptr< std::int64_t[] >, Subframe::PartitionedRice > ReadSubframe_Residual_PartitionedRice( BitStream &b, std::uint8_t const predictor_order, std::uint8_t const bps, std::uint16_t const blocksize )
+std::tuple< arena::array< std::int64_t >, Subframe::PartitionedRice > ReadSubframe_Residual_PartitionedRice( BitStream &b, std::uint8_t const predictor_order, std::uint8_t const bps, std::uint16_t const blocksize )
 {
     static_assert( PARAMETER_LEN <= 8, "PARAMETER_LEN must be under or equal to 8" );
     auto bs = make_useful_bitstream( b );
-    std::unique_ptr< std::int64_t[] > residual;
+    arena::array< std::int64_t > residual;
     Subframe::PartitionedRice rice;
     std::uint8_t const partition_order = rice.order = bs.get( 4 );
     std::uint32_t const partitions = 1 << partition_order;
     constexpr std::uint8_t ESCAPE_PARAMETER = (1 << PARAMETER_LEN) - 1;
     if( (blocksize >> partition_order) < predictor_order )
         throw exception( "ReadSubframe_Residual_PartitionedRice: partition_order mismatch" );
-    residual         = std::make_unique< std::int64_t[] >( blocksize - predictor_order );
-    rice.parameters  = std::make_unique< std::uint8_t[] >( partitions );
-    rice.is_raw_bits = std::make_unique< bool[] >        ( partitions );
+    residual         = arena::make_array< std::int64_t >( blocksize - predictor_order );
+    rice.parameters  = arena::make_array< std::uint8_t >( partitions );
+    rice.is_raw_bits = arena::make_array< bool >        ( partitions );
     std::uint32_t sample = 0;
     for( std::uint32_t partition = 0; partition < partitions; ++partition )
     {
@@ -45,8 +47,9 @@ std::tuple< std::unique_ptr< std::int64_t[] >, Subframe::PartitionedRice > ReadS
         {
             std::uint8_t const bits_per_sample = rice.parameters[ partition ] = bs.get( 5 );
             rice.is_raw_bits[ partition ] = true;
+            // width 0: every residual of the partition is zero
             for( std::uint16_t u = 0; u < this_part_sample_num; ++u, ++sample )
-                residual[ sample ] = bs.get_int( bits_per_sample );
+                residual[ sample ] = bits_per_sample != 0 ? bs.get_int( bits_per_sample ) : 0;
         }
     }
     return std::make_tuple( std::move( residual ), std::move( rice ) );
@@ -122,7 +125,7 @@ Subframe::Verbatim ReadSubframe_Verbatim( BitStream &b, std::uint8_t const bps,
 {
     auto bs = make_useful_bitstream( b );
     Subframe::Verbatim v;
-    v.data = std::make_unique< std::int64_t[] >( blocksize );
+    v.data = arena::make_array< std::int64_t >( blocksize );
     for( std::uint16_t i = 0; i < blocksize; ++i )
         v.data[ i ] = bs.get_int( bps );
     return std::move( v );
@@ -325,7 +328,10 @@ Frame::Header ReadFrame_Header( BitStream &b, MetaData::StreamInfo const &si )
     case 0b110: h.bits_per_sample = 24; break;
     }
     assert( bs.is_byte_aligned() );
-    std::uint8_t const calculated_crc8 = crc8bs.get_hash().get();
+    std::uint8_t const calculated_crc8 = [ & ]{
+        metrics::timer timer( metrics::stage::CRC );
+        return crc8bs.get_hash().get();
+    }();
     auto noncrc8bs = make_useful_bitstream( b );
     h.crc = noncrc8bs.get( 8 );
     if( h.crc != calculated_crc8 )
@@ -337,6 +343,8 @@ Frame::Header ReadFrame_Header( BitStream &b, MetaData::StreamInfo const &si )
 
 Frame::Frame ReadFrame( bytestream<> &b, MetaData::StreamInfo const &si )
 {
+    metrics::timer timer( metrics::stage::READ );
+    std::size_t const frame_start = b.get_position();
     auto crc16bs = make_hash_bytestream< hash::crc16_hash >( b );
     auto crc16bits = make_bitstream( crc16bs );
     auto bs = make_useful_bitstream( crc16bits );
@@ -370,11 +378,15 @@ Frame::Frame ReadFrame( bytestream<> &b, MetaData::StreamInfo const &si )
         if( bs.get( 1 ) != 0b0 )
             throw exception( "ReadFrame: padding is not zero" );
     assert( bs.is_byte_aligned() );
-    std::uint16_t const calculated_crc16 = crc16bs.get_hash().get();
+    std::uint16_t const calculated_crc16 = [ & ]{
+        metrics::timer timer( metrics::stage::CRC );
+        return crc16bs.get_hash().get();
+    }();
     auto noncrc16bits = make_bitstream( b );
     f.footer = ReadFrame_Footer( noncrc16bits ); // ReadFrame_Footer only read crc
     if( f.footer.crc != calculated_crc16 )
         throw exception( "ReadFrame: crc mismatch" );
+    metrics::count_frame( f, b.get_position() - frame_start );
     return std::move( f );
 }
 
@@ -413,6 +425,27 @@ MetaData::StreamInfo ReadMetadata_StreamInfo( BitStream &b, std::uint32_t length
 
 /***********************************************************************************************************************/
 
+template< typename BitStream >
+static
+MetaData::SeekTable ReadMetadata_SeekTable( BitStream &b, std::uint32_t length )
+{
+    if( length % SEEKPOINT_LENGTH != 0 )
+        throw exception( "ReadMetadata_SeekTable: bad length" );
+    auto bs = make_useful_bitstream( b );
+    assert( bs.is_byte_aligned() );
+    MetaData::SeekTable st;
+    st.points.resize( length / SEEKPOINT_LENGTH );
+    for( auto &&p : st.points )
+    {
+        p.sample_number = bs.get( 64 );
+        p.stream_offset = bs.get( 64 );
+        p.frame_samples = bs.get( 16 );
+    }
+    return std::move( st );
+}
+
+/***********************************************************************************************************************/
+
 MetaData::Metadata ReadMetadata( bytestream<> &b )
 {
     bitstream< bytestream<> > bits( b );
@@ -430,6 +463,9 @@ MetaData::Metadata ReadMetadata( bytestream<> &b )
     case MetaData::Type::PADDING:
         md.data = ReadMetadata_Padding( bs, md.length );
         break;
+    case MetaData::Type::SEEKTABLE:
+        md.data = ReadMetadata_SeekTable( bs, md.length );
+        break;
     }
     bs.set_position( position );
     bs.skip_byte( md.length );
@@ -5,6 +5,7 @@
 #include "buffer.hpp"
 #include "flac_struct.hpp"
 #include "hash.hpp"
+#include "metrics.hpp"
 #include "utility.hpp"
 
 #define SHOW(op) do{ std::cout << __func__ << ":L." << __LINE__ << ": " << #op << " = " << static_cast< std::intmax_t >( op ) << std::endl; }while( false )
@@ -35,17 +36,19 @@ void WriteSubframe_Residual_PartitionedRice( BitStream &b, std::int64_t const *r
             if( rice.parameters[ partition ] >= ESCAPE_PARAMETER )
                 throw exception( "WriteSubframe_Residual_PartitionedRice: parameter is too big" );
             bs.put( rice.parameters[ partition ], PARAMETER_LEN );
-            std::uint8_t const rice_parameter = rice.parameters[ partition ];
-            for( std::uint16_t u = 0; u < this_part_sample_num; ++u, ++sample )
-                bs.put_rice_int( residual[ sample ], rice_parameter );
+            bs.put_rice_block( residual + sample, this_part_sample_num, rice.parameters[ partition ] );
+            sample += this_part_sample_num;
         }
         else
         {
             bs.put( ESCAPE_PARAMETER, PARAMETER_LEN );
             std::uint8_t const bits_per_sample = rice.parameters[ partition ];
             bs.put( bits_per_sample, 5 );
-            for( std::uint16_t u = 0; u < this_part_sample_num; ++u, ++sample )
-                bs.put_int( residual[ sample ], bits_per_sample );
+            if( bits_per_sample != 0 )
+                for( std::uint16_t u = 0; u < this_part_sample_num; ++u, ++sample )
+                    bs.put_int( residual[ sample ], bits_per_sample );
+            else
+                sample += this_part_sample_num;
         }
     }
 }
@@ -186,14 +189,19 @@ void WriteSubframe( BitStream &b, Subframe::Subframe const &sf, std::uint8_t con
 
 /***********************************************************************************************************************/
 
+// frame_start: the position of the frame in the bytestream
 template< typename BitStream >
 static
-void WriteFrame_Footer( BitStream &b, Frame::Footer const &f )
+void WriteFrame_Footer( BitStream &b, Frame::Footer const &f, std::size_t const frame_start )
 {
     assert( b.is_byte_aligned() );
     auto bs = make_useful_bitstream( b );
-    hash::crc16_hash const &crc16_hash = bs.get_bytestream().get_hash();
-    std::uint16_t const calculated_crc16 = crc16_hash.get();
+    bs.get_bitstream().flush();
+    std::size_t const frame_end = std::get< 0 >( bs.get_position() );
+    std::uint16_t const calculated_crc16 = [ & ]{
+        metrics::timer timer( metrics::stage::CRC );
+        return hash::crc16( bs.get_bytestream().data() + frame_start, frame_end - frame_start );
+    }();
     bs.put( calculated_crc16, 16 );
 }
 
@@ -204,9 +212,8 @@ static
 void WriteFrame_Header( BitStream &b, Frame::Header const &h )
 {
     assert( b.is_byte_aligned() );
-    auto crc8bs = make_hash_bytestream< hash::crc8_hash >( b.get_bytestream() );
-    auto crc8bits = make_bitstream( crc8bs );
-    auto bs = make_useful_bitstream( crc8bits );
+    auto bs = make_useful_bitstream( b );
+    std::size_t const header_start = std::get< 0 >( bs.get_position() );
     bs.put( FRAME_HEADER_SYNC, 14 );
     bs.put( 0, 1 ); // reserved
     bs.put( static_cast< std::uint8_t >( h.number_type ), 1 );
@@ -341,18 +348,33 @@ void WriteFrame_Header( BitStream &b, Frame::Header const &h )
     case 3: bs.put( h.sample_rate /   10, 16 ); break;
     }
     assert( bs.is_byte_aligned() );
-    std::uint8_t const calculated_crc8 = crc8bs.get_hash().get();
-    auto noncrc8bs = make_useful_bitstream( b );
-    noncrc8bs.put( calculated_crc8, 8 );
+    bs.get_bitstream().flush();
+    std::size_t const header_end = std::get< 0 >( bs.get_position() );
+    std::uint8_t const calculated_crc8 = [ & ]{
+        metrics::timer timer( metrics::stage::CRC );
+        return hash::crc8( bs.get_bytestream().data() + header_start, header_end - header_start );
+    }();
+    bs.put( calculated_crc8, 8 );
 }
 
 /***********************************************************************************************************************/
 
+// Room for the frames the encoder writes, which are never larger than verbatim ones:
+// header, footer, and per channel the subframe header, wasted bits and samples of bps + 1 bits.
+// Larger frames are still written, only with the bytestream growing on the way.
+static
+std::size_t FrameSizeHint( Frame::Header const &h ) noexcept
+{
+    return 16 + 2 + h.channels * (8 + (h.bits_per_sample + 1u) * h.blocksize / 8);
+}
+
 void WriteFrame( bytestream<> &b, Frame::Frame const &f )
 {
-    auto crc16bs = make_hash_bytestream< hash::crc16_hash >( b );
-    auto crc16bits = make_bitstream( crc16bs );
-    auto bs = make_useful_bitstream( crc16bits );
+    metrics::timer timer( metrics::stage::WRITE );
+    std::size_t const frame_start = b.get_position();
+    bitwriter bits( b );
+    bits.reserve( frame_start + FrameSizeHint( f.header ) );
+    auto bs = make_useful_bitstream( bits );
     WriteFrame_Header( bs, f.header );
     for( std::uint8_t i = 0; i < f.header.channels; ++i )
     {
@@ -381,7 +403,9 @@ void WriteFrame( bytestream<> &b, Frame::Frame const &f )
     while( std::get< 1 >( bs.get_position() ) )
         bs.put( 0, 1 );
     assert( bs.is_byte_aligned() );
-    WriteFrame_Footer( bs, f.footer );
+    WriteFrame_Footer( bs, f.footer, frame_start );
+    bits.flush();
+    metrics::count_frame( f, b.get_position() - frame_start );
 }
 
 /***********************************************************************************************************************/
@@ -419,6 +443,23 @@ void WriteMetadata_StreamInfo( BitStream &b, MetaData::StreamInfo const &si, std
     assert( bs.is_byte_aligned() );
 }
 
+template< typename BitStream >
+static
+void WriteMetadata_SeekTable( BitStream &b, MetaData::SeekTable const &st, std::uint32_t const length )
+{
+    if( length != SEEKPOINT_LENGTH * st.points.size() )
+        throw exception( "WriteMetadata_SeekTable: bad length" );
+    auto bs = make_useful_bitstream( b );
+    assert( bs.is_byte_aligned() );
+    for( auto &&p : st.points )
+    {
+        bs.put( p.sample_number, 64 );
+        bs.put( p.stream_offset, 64 );
+        bs.put( p.frame_samples, 16 );
+    }
+    assert( bs.is_byte_aligned() );
+}
+
 void WriteMetadata( bytestream<> &b, MetaData::Metadata const &md )
 {
     bitstream< bytestream<> > bits( b );
@@ -434,6 +475,10 @@ void WriteMetadata( bytestream<> &b, MetaData::Metadata const &md )
         break;
     case MetaData::Type::PADDING:
         WriteMetadata_Padding( bs, md.data.data< MetaData::Padding >(), md.length );
+        break;
+    case MetaData::Type::SEEKTABLE:
+        WriteMetadata_SeekTable( bs, md.data.data< MetaData::SeekTable >(), md.length );
+        break;
     }
     bs.set_position( position );
     bs.skip_byte( md.length );
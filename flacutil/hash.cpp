@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 #include "hash.hpp"
+#include "simd.hpp"
 
 namespace hash{
 
@@ -39,14 +43,33 @@ constexpr auto calc_crc8_table() noexcept
 }
 
 constexpr auto crc8_table = calc_crc8_table();
+// slice-by-8: table[ k ][ b ] is the crc of b followed by k zero bytes
+constexpr auto calc_crc8_slice_table() noexcept
+{
+    array< array< std::uint8_t, 256 >, 8 > buff = {};
+    for( int i = 0; i < 256; ++i )
+        buff[ 0 ][ i ] = crc8_table[ i ];
+    for( int k = 1; k < 8; ++k )
+        for( int i = 0; i < 256; ++i )
+            buff[ k ][ i ] = crc8_table[ buff[ k - 1 ][ i ] ];
+    return buff;
+}
+constexpr auto crc8_slice_table = calc_crc8_slice_table();
 void crc8_update( std::uint8_t &crc, std::uint8_t const data ) noexcept
 {
     crc = crc8_table[ crc ^ data ];
 }
 void crc8_update( std::uint8_t &crc, std::uint8_t const *data, std::size_t const len ) noexcept
 {
-    for( std::size_t i = 0; i < len; ++i )
-        crc8_update( crc, data[ i ] );
+    auto const &t = crc8_slice_table;
+    std::uint8_t c = crc;
+    std::size_t i = 0;
+    for( ; i + 8 <= len; i += 8 )
+        c = t[ 7 ][ data[ i ] ^ c ] ^ t[ 6 ][ data[ i + 1 ] ] ^ t[ 5 ][ data[ i + 2 ] ] ^ t[ 4 ][ data[ i + 3 ] ]
+          ^ t[ 3 ][ data[ i + 4 ] ] ^ t[ 2 ][ data[ i + 5 ] ] ^ t[ 1 ][ data[ i + 6 ] ] ^ t[ 0 ][ data[ i + 7 ] ];
+    for( ; i < len; ++i )
+        c = crc8_table[ c ^ data[ i ] ];
+    crc = c;
 }
 std::uint8_t crc8( std::uint8_t const *data, std::size_t const len ) noexcept
 {
@@ -76,14 +99,33 @@ constexpr auto calc_crc16_table() noexcept
     return buff;
 }
 constexpr auto crc16_table = calc_crc16_table();
+// slice-by-8: table[ k ][ b ] is the crc of b followed by k zero bytes
+constexpr auto calc_crc16_slice_table() noexcept
+{
+    array< array< std::uint16_t, 256 >, 8 > buff = {};
+    for( int i = 0; i < 256; ++i )
+        buff[ 0 ][ i ] = crc16_table[ i ];
+    for( int k = 1; k < 8; ++k )
+        for( int i = 0; i < 256; ++i )
+            buff[ k ][ i ] = static_cast< std::uint16_t >( (buff[ k - 1 ][ i ] << 8) ^ crc16_table[ buff[ k - 1 ][ i ] >> 8 ] );
+    return buff;
+}
+constexpr auto crc16_slice_table = calc_crc16_slice_table();
 void crc16_update( std::uint16_t &crc, std::uint8_t const data ) noexcept
 {
     crc = ((crc << 8) ^ crc16_table[ (crc >> 8) ^ data ]);
 }
 void crc16_update( std::uint16_t &crc, std::uint8_t const *data, std::size_t const len ) noexcept
 {
-    for( std::size_t i = 0; i < len; ++i )
-        crc16_update( crc, data[ i ] );
+    auto const &t = crc16_slice_table;
+    std::uint16_t c = crc;
+    std::size_t i = 0;
+    for( ; i + 8 <= len; i += 8 )
+        c = t[ 7 ][ data[ i ] ^ (c >> 8) ] ^ t[ 6 ][ data[ i + 1 ] ^ (c & 0xff) ] ^ t[ 5 ][ data[ i + 2 ] ] ^ t[ 4 ][ data[ i + 3 ] ]
+          ^ t[ 3 ][ data[ i + 4 ] ] ^ t[ 2 ][ data[ i + 5 ] ] ^ t[ 1 ][ data[ i + 6 ] ] ^ t[ 0 ][ data[ i + 7 ] ];
+    for( ; i < len; ++i )
+        c = static_cast< std::uint16_t >( (c << 8) ^ crc16_table[ (c >> 8) ^ data[ i ] ] );
+    crc = c;
 }
 std::uint16_t crc16( std::uint8_t const *data, std::size_t const len ) noexcept
 {
@@ -92,4 +134,103 @@ std::uint16_t crc16( std::uint8_t const *data, std::size_t const len ) noexcept
     return crc;
 }
 
+md5_hash::md5_hash() noexcept
+    : state{ 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 }
+    , length( 0 )
+{
+}
+// complete the pending block from data
+// return: the number of bytes taken from data
+std::size_t md5_hash::fill_pending( std::uint8_t const *data, std::size_t const len ) noexcept
+{
+    std::size_t const used = length % 64;
+    if( used == 0 )
+        return 0;
+    std::size_t const n = std::min( len, 64 - used );
+    std::memcpy( pending + used, data, n );
+    length += n;
+    if( used + n == 64 )
+    {
+        std::uint8_t const *block = pending;
+        simd::md5_blocks( &state, &block, 1, 1 );
+    }
+    return n;
+}
+void md5_hash::update( std::uint8_t const *data, std::size_t len ) noexcept
+{
+    std::size_t const n = fill_pending( data, len );
+    data += n;
+    len -= n;
+    std::size_t const blocks = len / 64;
+    simd::md5_blocks( &state, &data, blocks, 1 );
+    length += 64 * blocks;
+    data += 64 * blocks;
+    len -= 64 * blocks;
+    std::memcpy( pending, data, len );
+    length += len;
+}
+std::array< std::uint8_t, 16 > md5_hash::get() const noexcept
+{
+    md5_hash h = *this;
+    std::uint8_t padding[ 72 ] = { 0x80 };
+    std::size_t const used = length % 64;
+    std::size_t const pad = (used < 56 ? 56 : 120) - used;
+    std::uint64_t const bits = length * 8;
+    for( std::size_t i = 0; i < 8; ++i )
+        padding[ pad + i ] = static_cast< std::uint8_t >( bits >> (8 * i) );
+    h.update( padding, pad + 8 );
+    std::array< std::uint8_t, 16 > digest;
+    for( std::size_t i = 0; i < 16; ++i )
+        digest[ i ] = static_cast< std::uint8_t >( h.state[ i / 4 ] >> (8 * (i % 4)) );
+    return digest;
+}
+void md5_update( md5_hash *const *hashes, std::uint8_t const *const *data, std::size_t const *len, std::size_t const count ) noexcept
+{
+    std::vector< std::uint8_t const * > p( data, data + count );
+    std::vector< std::size_t > rest( len, len + count );
+    for( std::size_t i = 0; i < count; ++i )
+    {
+        std::size_t const n = hashes[ i ]->fill_pending( p[ i ], rest[ i ] );
+        p[ i ] += n;
+        rest[ i ] -= n;
+    }
+    // the whole blocks, as many streams at a time as have one left
+    std::uint32_t state[ 8 ][ 4 ];
+    std::uint8_t const *lane_data[ 8 ];
+    std::size_t lane_stream[ 8 ];
+    std::size_t next = 0;
+    while( true )
+    {
+        std::size_t lanes = 0;
+        std::size_t blocks = 0;
+        for( std::size_t i = next; i < count && lanes < 8; ++i )
+        {
+            if( rest[ i ] < 64 )
+                continue;
+            lane_stream[ lanes++ ] = i;
+            blocks = blocks == 0 ? rest[ i ] / 64 : std::min( blocks, rest[ i ] / 64 );
+        }
+        if( lanes == 0 )
+            break;
+        for( std::size_t l = 0; l < lanes; ++l )
+        {
+            std::memcpy( state[ l ], hashes[ lane_stream[ l ] ]->state, sizeof( state[ l ] ) );
+            lane_data[ l ] = p[ lane_stream[ l ] ];
+        }
+        simd::md5_blocks( state, lane_data, blocks, lanes );
+        for( std::size_t l = 0; l < lanes; ++l )
+        {
+            std::size_t const i = lane_stream[ l ];
+            std::memcpy( hashes[ i ]->state, state[ l ], sizeof( state[ l ] ) );
+            hashes[ i ]->length += 64 * blocks;
+            p[ i ] += 64 * blocks;
+            rest[ i ] -= 64 * blocks;
+        }
+        while( next < count && rest[ next ] < 64 )
+            ++next;
+    }
+    for( std::size_t i = 0; i < count; ++i )
+        hashes[ i ]->update( p[ i ], rest[ i ] );
+}
+
 } // namespace hash
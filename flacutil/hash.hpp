@@ -1,6 +1,7 @@
 #ifndef FLACUTIL_HASH_HPP
 #define FLACUTIL_HASH_HPP
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 
@@ -24,6 +25,10 @@ public:
     {
         crc8_update( crc, val );
     }
+    void update( std::uint8_t const *data, std::size_t const len ) noexcept
+    {
+        crc8_update( crc, data, len );
+    }
     std::uint8_t get() const noexcept
     {
         return crc;
@@ -40,12 +45,36 @@ public:
     {
         crc16_update( crc, val );
     }
+    void update( std::uint8_t const *data, std::size_t const len ) noexcept
+    {
+        crc16_update( crc, data, len );
+    }
     std::uint16_t get() const noexcept
     {
         return crc;
     }
 };
 
+class md5_hash
+{
+private:
+    std::uint32_t state[ 4 ];
+    std::uint64_t length;        // in bytes
+    std::uint8_t  pending[ 64 ]; // the last length % 64 bytes
+
+    std::size_t fill_pending( std::uint8_t const *data, std::size_t len ) noexcept;
+    friend void md5_update( md5_hash *const *hashes, std::uint8_t const *const *data, std::size_t const *len, std::size_t count ) noexcept;
+
+public:
+    md5_hash() noexcept;
+    void update( std::uint8_t const *data, std::size_t len ) noexcept;
+    // the digest of the data so far
+    std::array< std::uint8_t, 16 > get() const noexcept;
+};
+// hashes[ i ]->update( data[ i ], len[ i ] ) for i < count, with the streams hashed side by side
+// when SIMD is available (multi-buffer MD5)
+void md5_update( md5_hash *const *hashes, std::uint8_t const *const *data, std::size_t const *len, std::size_t count ) noexcept;
+
 } // namespace hash
 
 #endif // FLACUTIL_HASH_HPP
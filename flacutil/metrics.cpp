@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "flac_struct.hpp"
+#include "metrics.hpp"
+
+namespace metrics
+{
+
+using clock = std::chrono::steady_clock;
+
+namespace detail
+{
+
+std::atomic< bool > enabled( false );
+
+thread_counters::thread_counters() noexcept
+{
+    for( auto &&v : values )
+        v.store( 0, std::memory_order_relaxed );
+}
+
+// the counters outlive their threads, so that the pool workers are still reported after the pool is gone
+static std::mutex                                       registry_mutex;
+static std::vector< std::unique_ptr< thread_counters > > registry;
+static std::atomic< clock::rep >                        start_time( 0 );
+
+thread_counters &local()
+{
+    static thread_local thread_counters *counters = nullptr;
+    if( !counters )
+    {
+        std::lock_guard< std::mutex > lg( registry_mutex );
+        registry.emplace_back( std::make_unique< thread_counters >() );
+        counters = registry.back().get();
+    }
+    return *counters;
+}
+
+// the running timer of the thread and since when it runs (or was resumed)
+static thread_local stage             active = stage::NONE;
+static thread_local clock::time_point since;
+
+static
+void add_time( clock::time_point const now ) noexcept
+{
+    if( active != stage::NONE )
+        local().add( NANOSECONDS + static_cast< std::size_t >( active ), std::chrono::duration_cast< std::chrono::nanoseconds >( now - since ).count() );
+}
+stage start( stage const s ) noexcept
+{
+    auto const now = clock::now();
+    add_time( now );
+    stage const parent = active;
+    active = s;
+    since = now;
+    return parent;
+}
+void stop( stage const parent ) noexcept
+{
+    auto const now = clock::now();
+    add_time( now );
+    active = parent;
+    since = now;
+}
+
+} // namespace detail
+
+void enable() noexcept
+{
+    detail::start_time.store( clock::now().time_since_epoch().count() );
+    detail::enabled.store( true );
+}
+
+void count_frame( FLAC::Frame::Frame const &f, std::uint64_t const bytes ) noexcept
+{
+    if( !is_enabled() )
+        return;
+    auto &c = detail::local();
+    c.add( FRAMES, 1 );
+    c.add( SAMPLES, f.header.blocksize );
+    c.add( BYTES, bytes );
+    for( std::uint8_t ch = 0; ch < f.header.channels; ++ch )
+    {
+        FLAC::Subframe::Subframe const &sf = f.subframes[ ch ];
+        c.add( TYPES + static_cast< std::size_t >( sf.header.type ), 1 );
+        if( sf.header.type == FLAC::Subframe::Type::FIXED )
+            c.add( FIXED_ORDER + sf.data.data< FLAC::Subframe::Fixed >().order, 1 );
+        else if( sf.header.type == FLAC::Subframe::Type::LPC )
+            c.add( LPC_ORDER + sf.data.data< FLAC::Subframe::LPC >().order, 1 );
+    }
+}
+
+std::vector< counters > snapshot()
+{
+    std::lock_guard< std::mutex > lg( detail::registry_mutex );
+    std::vector< counters > threads;
+    for( auto &&t : detail::registry )
+    {
+        counters c;
+        for( std::size_t i = 0; i < COUNTERS; ++i )
+            c[ i ] = t->values[ i ].load( std::memory_order_relaxed );
+        threads.push_back( c );
+    }
+    return threads;
+}
+double elapsed() noexcept
+{
+    clock::duration const d = clock::now().time_since_epoch() - clock::duration( detail::start_time.load() );
+    return std::chrono::duration< double >( d ).count();
+}
+
+static char const *const stage_names[ STAGES ] = { "prediction", "rice_search", "write", "read", "crc" };
+static char const *const type_names[ 4 ] = { "constant", "verbatim", "fixed", "lpc" };
+
+static
+std::string to_json( std::vector< counters > const &threads, counters const &total, double const seconds )
+{
+    std::ostringstream os;
+    auto print = [ & ]( counters const &c )
+    {
+        os << "{\"frames\":" << c[ FRAMES ] << ",\"samples\":" << c[ SAMPLES ] << ",\"bytes\":" << c[ BYTES ] << ",\"seconds\":{";
+        for( std::size_t s = 0; s < STAGES; ++s )
+            os << (s ? "," : "") << '"' << stage_names[ s ] << "\":" << c[ NANOSECONDS + s ] * 1e-9;
+        os << "},\"subframe_types\":{";
+        for( std::size_t t = 0; t < 4; ++t )
+            os << (t ? "," : "") << '"' << type_names[ t ] << "\":" << c[ TYPES + t ];
+        os << "},\"fixed_orders\":[";
+        for( std::size_t o = 0; o <= FLAC::MAX_FIXED_ORDER; ++o )
+            os << (o ? "," : "") << c[ FIXED_ORDER + o ];
+        os << "],\"lpc_orders\":[";
+        for( std::size_t o = 0; o <= FLAC::MAX_LPC_ORDER; ++o )
+            os << (o ? "," : "") << c[ LPC_ORDER + o ];
+        os << "]}";
+    };
+    os << "{\"elapsed_seconds\":" << seconds;
+    os << ",\"samples_per_second\":" << (seconds > 0 ? total[ SAMPLES ] / seconds : 0.0);
+    os << ",\"bytes_per_second\":" << (seconds > 0 ? total[ BYTES ] / seconds : 0.0);
+    os << ",\"total\":";
+    print( total );
+    os << ",\"threads\":[";
+    for( std::size_t i = 0; i < threads.size(); ++i )
+    {
+        os << (i ? "," : "");
+        print( threads[ i ] );
+    }
+    os << "]}\n";
+    return os.str();
+}
+static
+std::string to_prometheus( std::vector< counters > const &threads, counters const &total, double const seconds )
+{
+    std::ostringstream os;
+    auto header = [ & ]( char const *name, char const *type, char const *help )
+    {
+        os << "# HELP " << name << ' ' << help << '\n' << "# TYPE " << name << ' ' << type << '\n';
+    };
+    header( "flac_elapsed_seconds", "gauge", "Seconds since the metrics were enabled." );
+    os << "flac_elapsed_seconds " << seconds << '\n';
+    struct { std::size_t index; char const *name; char const *help; } const per_thread[] = {
+        { FRAMES,  "flac_frames_total",  "Frames written or read." },
+        { SAMPLES, "flac_samples_total", "Samples per channel of the frames." },
+        { BYTES,   "flac_bytes_total",   "Bytes of the frames." },
+    };
+    for( auto &&m : per_thread )
+    {
+        header( m.name, "counter", m.help );
+        for( std::size_t i = 0; i < threads.size(); ++i )
+            os << m.name << "{thread=\"" << i << "\"} " << threads[ i ][ m.index ] << '\n';
+    }
+    header( "flac_stage_seconds_total", "counter", "Time spent in each stage." );
+    for( std::size_t i = 0; i < threads.size(); ++i )
+        for( std::size_t s = 0; s < STAGES; ++s )
+            os << "flac_stage_seconds_total{thread=\"" << i << "\",stage=\"" << stage_names[ s ] << "\"} " << threads[ i ][ NANOSECONDS + s ] * 1e-9 << '\n';
+    header( "flac_subframes_total", "counter", "Subframes by type." );
+    for( std::size_t t = 0; t < 4; ++t )
+        os << "flac_subframes_total{type=\"" << type_names[ t ] << "\"} " << total[ TYPES + t ] << '\n';
+    header( "flac_subframe_orders_total", "counter", "FIXED and LPC subframes by predictor order." );
+    for( std::size_t o = 0; o <= FLAC::MAX_FIXED_ORDER; ++o )
+        os << "flac_subframe_orders_total{type=\"fixed\",order=\"" << o << "\"} " << total[ FIXED_ORDER + o ] << '\n';
+    for( std::size_t o = 1; o <= FLAC::MAX_LPC_ORDER; ++o )
+        os << "flac_subframe_orders_total{type=\"lpc\",order=\"" << o << "\"} " << total[ LPC_ORDER + o ] << '\n';
+    return os.str();
+}
+format format_for( std::string const &path ) noexcept
+{
+    static char const ext[] = ".prom";
+    std::size_t const len = sizeof( ext ) - 1;
+    if( path.size() >= len && path.compare( path.size() - len, len, ext ) == 0 )
+        return format::PROMETHEUS;
+    return format::JSON;
+}
+std::string to_string( std::vector< counters > const &threads, double const seconds, format const f )
+{
+    counters total = {};
+    for( auto &&t : threads )
+        for( std::size_t i = 0; i < COUNTERS; ++i )
+            total[ i ] += t[ i ];
+    return f == format::JSON ? to_json( threads, total, seconds ) : to_prometheus( threads, total, seconds );
+}
+void write_file( std::string const &path, format const f )
+{
+    std::string const tmp = path + ".tmp";
+    {
+        std::ofstream ofs( tmp, std::ios::binary );
+        ofs << to_string( snapshot(), elapsed(), f );
+        if( !ofs.flush() )
+            throw FLAC::exception( "metrics::write_file: write error" );
+    }
+    if( std::rename( tmp.c_str(), path.c_str() ) != 0 )
+        throw FLAC::exception( "metrics::write_file: rename error" );
+}
+
+reporter::reporter( std::string path, format const f, unsigned int const interval )
+    : path( std::move( path ) )
+    , fmt( f )
+    , interval( interval )
+{
+    if( interval != 0 )
+        thread = std::thread( [ this ]{
+            std::unique_lock< std::mutex > ul( mutex );
+            while( !cond.wait_for( ul, this->interval, [ & ]{ return stop; } ) )
+            {
+                ul.unlock();
+                try
+                {
+                    write_file( this->path, fmt );
+                }
+                catch( ... )
+                {
+                    // the next report tries again
+                }
+                ul.lock();
+            }
+        } );
+}
+reporter::~reporter()
+{
+    {
+        std::lock_guard< std::mutex > lg( mutex );
+        stop = true;
+    }
+    cond.notify_all();
+    if( thread.joinable() )
+        thread.join();
+}
+void reporter::finish()
+{
+    {
+        std::lock_guard< std::mutex > lg( mutex );
+        stop = true;
+    }
+    cond.notify_all();
+    if( thread.joinable() )
+        thread.join();
+    write_file( path, fmt );
+}
+
+} // namespace metrics
@@ -0,0 +1,136 @@
+#ifndef FLACUTIL_METRICS_HPP
+#define FLACUTIL_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "flac_struct.hpp"
+
+// Counters of the encoder and the decoder, kept per thread so that counting needs no
+// synchronization. Nothing is counted until enable() is called.
+namespace metrics
+{
+
+// where the time goes; a timer inside another one pauses the outer one
+enum class stage : std::uint8_t
+{
+    PREDICTION,  // candidate evaluation and residuals (encode), restoring the samples (decode)
+    RICE_SEARCH, // choosing the partitions and rice parameters
+    WRITE,       // serializing frames
+    READ,        // parsing frames
+    CRC,         // frame header and frame checksums
+    NONE,
+};
+constexpr std::size_t STAGES = static_cast< std::size_t >( stage::NONE );
+
+// the layout of counters
+constexpr std::size_t FRAMES      = 0;
+constexpr std::size_t SAMPLES     = 1;                                      // per channel
+constexpr std::size_t BYTES       = 2;                                      // of the frames
+constexpr std::size_t NANOSECONDS = 3;                                      // [ STAGES ]
+constexpr std::size_t TYPES       = NANOSECONDS + STAGES;                   // [ 4 ], by Subframe::Type
+constexpr std::size_t FIXED_ORDER = TYPES + 4;                              // [ MAX_FIXED_ORDER + 1 ]
+constexpr std::size_t LPC_ORDER   = FIXED_ORDER + FLAC::MAX_FIXED_ORDER + 1; // [ MAX_LPC_ORDER + 1 ]
+constexpr std::size_t COUNTERS    = LPC_ORDER + FLAC::MAX_LPC_ORDER + 1;
+using counters = std::array< std::uint64_t, COUNTERS >;
+
+namespace detail
+{
+    extern std::atomic< bool > enabled;
+    // the counters of one thread, written only by that thread
+    struct thread_counters
+    {
+        std::atomic< std::uint64_t > values[ COUNTERS ];
+
+        thread_counters() noexcept;
+        void add( std::size_t const index, std::uint64_t const v ) noexcept
+        {
+            values[ index ].store( values[ index ].load( std::memory_order_relaxed ) + v, std::memory_order_relaxed );
+        }
+    };
+    thread_counters &local();
+    stage start( stage s ) noexcept;
+    void stop( stage parent ) noexcept;
+} // namespace detail
+
+// start counting; the elapsed time of the reports starts here
+void enable() noexcept;
+inline bool is_enabled() noexcept
+{
+    return detail::enabled.load( std::memory_order_relaxed );
+}
+
+// a frame of bytes bytes was written or read: its samples and the types and orders of its subframes
+void count_frame( FLAC::Frame::Frame const &f, std::uint64_t bytes ) noexcept;
+
+// Adds the time of its scope to a stage of the calling thread.
+class timer
+{
+private:
+    bool  on;
+    stage parent;
+
+public:
+    explicit timer( stage const s ) noexcept
+        : on( is_enabled() )
+        , parent( stage::NONE )
+    {
+        if( on )
+            parent = detail::start( s );
+    }
+    timer( timer const & ) = delete;
+    timer &operator=( timer const & ) = delete;
+    ~timer()
+    {
+        if( on )
+            detail::stop( parent );
+    }
+};
+
+// the counters of every thread that counted something, in the order they started counting
+std::vector< counters > snapshot();
+// seconds since enable()
+double elapsed() noexcept;
+
+enum class format
+{
+    JSON,
+    PROMETHEUS, // text exposition format, e.g. for the textfile collector of node_exporter
+};
+// PROMETHEUS for a path ending with ".prom", JSON otherwise
+format format_for( std::string const &path ) noexcept;
+std::string to_string( std::vector< counters > const &threads, double seconds, format f );
+// replace path with the current metrics; written to a temporary file first, so that
+// a reader never sees a partial file
+void write_file( std::string const &path, format f );
+
+// Writes the metrics to a file every interval seconds (never if 0) and once more at finish().
+class reporter
+{
+private:
+    std::string const             path;
+    format const                  fmt;
+    std::chrono::seconds const    interval;
+    std::mutex                    mutex;
+    std::condition_variable       cond;
+    bool                          stop = false;
+    std::thread                   thread;
+
+public:
+    reporter( std::string path, format f, unsigned int interval );
+    reporter( reporter const & ) = delete;
+    reporter &operator=( reporter const & ) = delete;
+    ~reporter();
+    void finish();
+};
+
+} // namespace metrics
+
+#endif // FLACUTIL_METRICS_HPP
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hpp"
+
+#if defined( __GNUC__ ) && (defined( __x86_64__ ) || defined( __i386__ ))
+#define FLACUTIL_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace simd{
+
+static
+void add_bit_counts_generic( std::uint32_t const *src, std::size_t const n, std::uint8_t const bits, std::uint64_t *count ) noexcept
+{
+    for( std::uint8_t b = 0; b < bits; ++b )
+    {
+        std::uint64_t c = 0;
+        for( std::size_t i = 0; i < n; ++i )
+            c += (src[ i ] >> b) & 1;
+        count[ b ] += c;
+    }
+}
+
+// the orders that src[ i ] has a residual of, for i < 4
+template< typename T >
+static
+void fixed_residuals_head( T const *src, std::size_t const i, std::int64_t *const *residual ) noexcept
+{
+    // successive differences: a[ j ] holds the order k difference at i - j
+    std::int64_t a[ 4 ];
+    for( std::size_t j = 0; j <= i; ++j )
+        a[ j ] = src[ i - j ];
+    residual[ 0 ][ i ] = a[ 0 ];
+    for( std::size_t k = 1; k <= i; ++k )
+    {
+        for( std::size_t j = 0; j + k <= i; ++j )
+            a[ j ] -= a[ j + 1 ];
+        residual[ k ][ i - k ] = a[ 0 ];
+    }
+}
+// i >= 4
+template< typename T >
+static
+void fixed_residuals_generic( T const *src, std::size_t const begin, std::size_t const end, std::int64_t *const *residual ) noexcept
+{
+    std::int64_t *r0 = residual[ 0 ], *r1 = residual[ 1 ], *r2 = residual[ 2 ], *r3 = residual[ 3 ], *r4 = residual[ 4 ];
+    for( std::size_t i = begin; i < end; ++i )
+    {
+        std::int64_t const a0 = src[ i ], a1 = src[ i - 1 ], a2 = src[ i - 2 ], a3 = src[ i - 3 ], a4 = src[ i - 4 ];
+        std::int64_t const e0 = a0 - a1, e1 = a1 - a2, e2 = a2 - a3, e3 = a3 - a4;
+        std::int64_t const f0 = e0 - e1, f1 = e1 - e2, f2 = e2 - e3;
+        std::int64_t const g0 = f0 - f1, g1 = f1 - f2;
+        r0[ i ] = a0;
+        r1[ i - 1 ] = e0;
+        r2[ i - 2 ] = f0;
+        r3[ i - 3 ] = g0;
+        r4[ i - 4 ] = g0 - g1;
+    }
+}
+
+// RFC 1321
+constexpr std::uint32_t md5_k[ 64 ] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+constexpr std::uint8_t md5_r[ 4 ][ 4 ] = { { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 } };
+// the message word used by step i
+constexpr std::uint8_t md5_g( std::size_t const i ) noexcept
+{
+    return i < 16 ? i : i < 32 ? (5 * i + 1) % 16 : i < 48 ? (3 * i + 5) % 16 : (7 * i) % 16;
+}
+
+static
+std::uint32_t load_le32( std::uint8_t const *p ) noexcept
+{
+    return static_cast< std::uint32_t >( p[ 0 ] ) | static_cast< std::uint32_t >( p[ 1 ] ) << 8 | static_cast< std::uint32_t >( p[ 2 ] ) << 16 | static_cast< std::uint32_t >( p[ 3 ] ) << 24;
+}
+static
+void md5_blocks_generic( std::uint32_t *state, std::uint8_t const *data, std::size_t const blocks ) noexcept
+{
+    for( std::size_t n = 0; n < blocks; ++n, data += 64 )
+    {
+        std::uint32_t m[ 16 ];
+        for( std::size_t j = 0; j < 16; ++j )
+            m[ j ] = load_le32( data + 4 * j );
+        std::uint32_t a = state[ 0 ], b = state[ 1 ], c = state[ 2 ], d = state[ 3 ];
+        // one loop per round, so that each is unrolled with constant rotations
+        auto const step = [ & ]( std::size_t const i, std::uint32_t f ) {
+            f += a + md5_k[ i ] + m[ md5_g( i ) ];
+            std::uint8_t const r = md5_r[ i / 16 ][ i % 4 ];
+            a = d;
+            d = c;
+            c = b;
+            b += (f << r) | (f >> (32 - r));
+        };
+        for( std::size_t i = 0; i < 16; ++i )
+            step( i, (b & c) | (~b & d) );
+        for( std::size_t i = 16; i < 32; ++i )
+            step( i, (d & b) | (~d & c) );
+        for( std::size_t i = 32; i < 48; ++i )
+            step( i, b ^ c ^ d );
+        for( std::size_t i = 48; i < 64; ++i )
+            step( i, c ^ (b | ~d) );
+        state[ 0 ] += a;
+        state[ 1 ] += b;
+        state[ 2 ] += c;
+        state[ 3 ] += d;
+    }
+}
+
+#ifdef FLACUTIL_SIMD_X86
+__attribute__(( target( "avx2" ) ))
+static
+void add_bit_counts_avx2( std::uint32_t const *src, std::size_t const n, std::uint8_t const bits, std::uint64_t *count ) noexcept
+{
+    __m256i const one = _mm256_set1_epi32( 1 );
+    std::size_t const vn = n & ~static_cast< std::size_t >( 7 );
+    for( std::uint8_t b = 0; b < bits; ++b )
+    {
+        __m128i const shift = _mm_cvtsi32_si128( b );
+        // a lane counts at most n / 8 values, so 32 bit lanes do not overflow
+        __m256i acc = _mm256_setzero_si256();
+        for( std::size_t i = 0; i < vn; i += 8 )
+        {
+            __m256i const v = _mm256_loadu_si256( reinterpret_cast< __m256i const * >( src + i ) );
+            acc = _mm256_add_epi32( acc, _mm256_and_si256( _mm256_srl_epi32( v, shift ), one ) );
+        }
+        alignas( 32 ) std::uint32_t lanes[ 8 ];
+        _mm256_store_si256( reinterpret_cast< __m256i * >( lanes ), acc );
+        std::uint64_t c = 0;
+        for( unsigned int l = 0; l < 8; ++l )
+            c += lanes[ l ];
+        for( std::size_t i = vn; i < n; ++i )
+            c += (src[ i ] >> b) & 1;
+        count[ b ] += c;
+    }
+}
+
+// src[ 0 .. 3 ] as 64 bit lanes
+__attribute__(( target( "avx2" ) ))
+static inline
+__m256i load4_avx2( std::int16_t const *src ) noexcept
+{
+    return _mm256_cvtepi16_epi64( _mm_loadl_epi64( reinterpret_cast< __m128i const * >( src ) ) );
+}
+__attribute__(( target( "avx2" ) ))
+static inline
+__m256i load4_avx2( std::int32_t const *src ) noexcept
+{
+    return _mm256_cvtepi32_epi64( _mm_loadu_si128( reinterpret_cast< __m128i const * >( src ) ) );
+}
+__attribute__(( target( "avx2" ) ))
+static inline
+__m256i load4_avx2( std::int64_t const *src ) noexcept
+{
+    return _mm256_loadu_si256( reinterpret_cast< __m256i const * >( src ) );
+}
+// src[ 0 .. 7 ] as 32 bit lanes
+__attribute__(( target( "avx2" ) ))
+static inline
+__m256i load8_avx2( std::int16_t const *src ) noexcept
+{
+    return _mm256_cvtepi16_epi32( _mm_loadu_si128( reinterpret_cast< __m128i const * >( src ) ) );
+}
+__attribute__(( target( "avx2" ) ))
+static inline
+__m256i load8_avx2( std::int32_t const *src ) noexcept
+{
+    return _mm256_loadu_si256( reinterpret_cast< __m256i const * >( src ) );
+}
+// the low 32 bits of src[ 0 .. 7 ]
+__attribute__(( target( "avx2" ) ))
+static inline
+__m256i load8_avx2( std::int64_t const *src ) noexcept
+{
+    __m256 const lo = _mm256_castsi256_ps( _mm256_loadu_si256( reinterpret_cast< __m256i const * >( src ) ) );
+    __m256 const hi = _mm256_castsi256_ps( _mm256_loadu_si256( reinterpret_cast< __m256i const * >( src + 4 ) ) );
+    return _mm256_permute4x64_epi64( _mm256_castps_si256( _mm256_shuffle_ps( lo, hi, _MM_SHUFFLE( 2, 0, 2, 0 ) ) ), _MM_SHUFFLE( 3, 1, 2, 0 ) );
+}
+__attribute__(( target( "avx2" ) ))
+static inline
+void store_widen_avx2( std::int64_t *dst, __m256i const v ) noexcept
+{
+    _mm256_storeu_si256( reinterpret_cast< __m256i * >( dst ), _mm256_cvtepi32_epi64( _mm256_castsi256_si128( v ) ) );
+    _mm256_storeu_si256( reinterpret_cast< __m256i * >( dst + 4 ), _mm256_cvtepi32_epi64( _mm256_extracti128_si256( v, 1 ) ) );
+}
+// 64 bit lanes
+template< typename T >
+__attribute__(( target( "avx2" ) ))
+static
+std::size_t fixed_residuals_avx2( T const *src, std::size_t const n, std::int64_t *const *residual ) noexcept
+{
+    std::size_t i = 4;
+    for( ; i + 4 <= n; i += 4 )
+    {
+        __m256i const a0 = load4_avx2( src + i ), a1 = load4_avx2( src + i - 1 ), a2 = load4_avx2( src + i - 2 ), a3 = load4_avx2( src + i - 3 ), a4 = load4_avx2( src + i - 4 );
+        __m256i const e0 = _mm256_sub_epi64( a0, a1 ), e1 = _mm256_sub_epi64( a1, a2 ), e2 = _mm256_sub_epi64( a2, a3 ), e3 = _mm256_sub_epi64( a3, a4 );
+        __m256i const f0 = _mm256_sub_epi64( e0, e1 ), f1 = _mm256_sub_epi64( e1, e2 ), f2 = _mm256_sub_epi64( e2, e3 );
+        __m256i const g0 = _mm256_sub_epi64( f0, f1 ), g1 = _mm256_sub_epi64( f1, f2 );
+        _mm256_storeu_si256( reinterpret_cast< __m256i * >( residual[ 0 ] + i ), a0 );
+        _mm256_storeu_si256( reinterpret_cast< __m256i * >( residual[ 1 ] + i - 1 ), e0 );
+        _mm256_storeu_si256( reinterpret_cast< __m256i * >( residual[ 2 ] + i - 2 ), f0 );
+        _mm256_storeu_si256( reinterpret_cast< __m256i * >( residual[ 3 ] + i - 3 ), g0 );
+        _mm256_storeu_si256( reinterpret_cast< __m256i * >( residual[ 4 ] + i - 4 ), _mm256_sub_epi64( g0, g1 ) );
+    }
+    return i;
+}
+// 32 bit lanes, the shifted samples are loaded directly
+template< typename T >
+__attribute__(( target( "avx2" ) ))
+static
+std::size_t fixed_residuals_narrow_avx2( T const *src, std::size_t const n, std::int64_t *const *residual ) noexcept
+{
+    std::size_t i = 4;
+    for( ; i + 8 <= n; i += 8 )
+    {
+        __m256i const a0 = load8_avx2( src + i ), a1 = load8_avx2( src + i - 1 ), a2 = load8_avx2( src + i - 2 ), a3 = load8_avx2( src + i - 3 ), a4 = load8_avx2( src + i - 4 );
+        __m256i const e0 = _mm256_sub_epi32( a0, a1 ), e1 = _mm256_sub_epi32( a1, a2 ), e2 = _mm256_sub_epi32( a2, a3 ), e3 = _mm256_sub_epi32( a3, a4 );
+        __m256i const f0 = _mm256_sub_epi32( e0, e1 ), f1 = _mm256_sub_epi32( e1, e2 ), f2 = _mm256_sub_epi32( e2, e3 );
+        __m256i const g0 = _mm256_sub_epi32( f0, f1 ), g1 = _mm256_sub_epi32( f1, f2 );
+        store_widen_avx2( residual[ 0 ] + i, a0 );
+        store_widen_avx2( residual[ 1 ] + i - 1, e0 );
+        store_widen_avx2( residual[ 2 ] + i - 2, f0 );
+        store_widen_avx2( residual[ 3 ] + i - 3, g0 );
+        store_widen_avx2( residual[ 4 ] + i - 4, _mm256_sub_epi32( g0, g1 ) );
+    }
+    return i;
+}
+// 32 bit lanes from 64 bit samples: narrow each sample once, and build the shifted vectors from the previous one
+__attribute__(( target( "avx2" ) ))
+static
+std::size_t fixed_residuals_narrow_avx2( std::int64_t const *src, std::size_t const n, std::int64_t *const *residual ) noexcept
+{
+    if( n < 16 )
+        return 4;
+    fixed_residuals_generic( src, 4, 8, residual );
+    __m256i prev = load8_avx2( src );
+    std::size_t i = 8;
+    for( ; i + 8 <= n; i += 8 )
+    {
+        __m256i const a0 = load8_avx2( src + i );
+        // [ prev[ 4 .. 7 ], a0[ 0 .. 3 ] ], then shifted by j elements
+        __m256i const mid = _mm256_permute2x128_si256( prev, a0, 0x21 );
+        __m256i const a1 = _mm256_alignr_epi8( a0, mid, 12 );
+        __m256i const a2 = _mm256_alignr_epi8( a0, mid, 8 );
+        __m256i const a3 = _mm256_alignr_epi8( a0, mid, 4 );
+        __m256i const a4 = mid;
+        __m256i const e0 = _mm256_sub_epi32( a0, a1 ), e1 = _mm256_sub_epi32( a1, a2 ), e2 = _mm256_sub_epi32( a2, a3 ), e3 = _mm256_sub_epi32( a3, a4 );
+        __m256i const f0 = _mm256_sub_epi32( e0, e1 ), f1 = _mm256_sub_epi32( e1, e2 ), f2 = _mm256_sub_epi32( e2, e3 );
+        __m256i const g0 = _mm256_sub_epi32( f0, f1 ), g1 = _mm256_sub_epi32( f1, f2 );
+        store_widen_avx2( residual[ 0 ] + i, a0 );
+        store_widen_avx2( residual[ 1 ] + i - 1, e0 );
+        store_widen_avx2( residual[ 2 ] + i - 2, f0 );
+        store_widen_avx2( residual[ 3 ] + i - 3, g0 );
+        store_widen_avx2( residual[ 4 ] + i - 4, _mm256_sub_epi32( g0, g1 ) );
+        prev = a0;
+    }
+    return i;
+}
+// step i of every lane, f: the round function of b, c and d
+__attribute__(( target( "avx2" ) ))
+static inline
+void md5_step_avx2( std::size_t const i, __m256i const &f, __m256i const *m, __m256i &a, __m256i &b, __m256i &c, __m256i &d ) noexcept
+{
+    __m256i const t = _mm256_add_epi32( _mm256_add_epi32( f, a ), _mm256_add_epi32( _mm256_set1_epi32( static_cast< int >( md5_k[ i ] ) ), m[ md5_g( i ) ] ) );
+    std::uint8_t const r = md5_r[ i / 16 ][ i % 4 ];
+    a = d;
+    d = c;
+    c = b;
+    b = _mm256_add_epi32( b, _mm256_or_si256( _mm256_sll_epi32( t, _mm_cvtsi32_si128( r ) ), _mm256_srl_epi32( t, _mm_cvtsi32_si128( 32 - r ) ) ) );
+}
+// lanes <= 8; the unused lanes hash the data of lane 0 and are discarded
+__attribute__(( target( "avx2" ) ))
+static
+void md5_blocks_avx2( std::uint32_t (*state)[ 4 ], std::uint8_t const *const *data, std::size_t const blocks, std::size_t const lanes ) noexcept
+{
+    std::uint8_t const *p[ 8 ];
+    for( std::size_t l = 0; l < 8; ++l )
+        p[ l ] = data[ l < lanes ? l : 0 ];
+    alignas( 32 ) std::uint32_t s[ 4 ][ 8 ];
+    for( std::size_t l = 0; l < 8; ++l )
+        for( std::size_t j = 0; j < 4; ++j )
+            s[ j ][ l ] = state[ l < lanes ? l : 0 ][ j ];
+    __m256i a0 = _mm256_load_si256( reinterpret_cast< __m256i const * >( s[ 0 ] ) );
+    __m256i b0 = _mm256_load_si256( reinterpret_cast< __m256i const * >( s[ 1 ] ) );
+    __m256i c0 = _mm256_load_si256( reinterpret_cast< __m256i const * >( s[ 2 ] ) );
+    __m256i d0 = _mm256_load_si256( reinterpret_cast< __m256i const * >( s[ 3 ] ) );
+    __m256i const ones = _mm256_set1_epi32( -1 );
+    for( std::size_t n = 0; n < blocks; ++n )
+    {
+        // word j of every lane
+        __m256i m[ 16 ];
+        for( std::size_t j = 0; j < 16; ++j )
+        {
+            std::size_t const o = 64 * n + 4 * j;
+            m[ j ] = _mm256_setr_epi32( load_le32( p[ 0 ] + o ), load_le32( p[ 1 ] + o ), load_le32( p[ 2 ] + o ), load_le32( p[ 3 ] + o ),
+                                        load_le32( p[ 4 ] + o ), load_le32( p[ 5 ] + o ), load_le32( p[ 6 ] + o ), load_le32( p[ 7 ] + o ) );
+        }
+        __m256i a = a0, b = b0, c = c0, d = d0;
+        for( std::size_t i = 0; i < 16; ++i )
+            md5_step_avx2( i, _mm256_or_si256( _mm256_and_si256( b, c ), _mm256_andnot_si256( b, d ) ), m, a, b, c, d );
+        for( std::size_t i = 16; i < 32; ++i )
+            md5_step_avx2( i, _mm256_or_si256( _mm256_and_si256( d, b ), _mm256_andnot_si256( d, c ) ), m, a, b, c, d );
+        for( std::size_t i = 32; i < 48; ++i )
+            md5_step_avx2( i, _mm256_xor_si256( _mm256_xor_si256( b, c ), d ), m, a, b, c, d );
+        for( std::size_t i = 48; i < 64; ++i )
+            md5_step_avx2( i, _mm256_xor_si256( c, _mm256_or_si256( b, _mm256_xor_si256( d, ones ) ) ), m, a, b, c, d );
+        a0 = _mm256_add_epi32( a0, a );
+        b0 = _mm256_add_epi32( b0, b );
+        c0 = _mm256_add_epi32( c0, c );
+        d0 = _mm256_add_epi32( d0, d );
+    }
+    _mm256_store_si256( reinterpret_cast< __m256i * >( s[ 0 ] ), a0 );
+    _mm256_store_si256( reinterpret_cast< __m256i * >( s[ 1 ] ), b0 );
+    _mm256_store_si256( reinterpret_cast< __m256i * >( s[ 2 ] ), c0 );
+    _mm256_store_si256( reinterpret_cast< __m256i * >( s[ 3 ] ), d0 );
+    for( std::size_t l = 0; l < lanes; ++l )
+        for( std::size_t j = 0; j < 4; ++j )
+            state[ l ][ j ] = s[ j ][ l ];
+}
+#endif
+
+bool has_avx2() noexcept
+{
+#ifdef FLACUTIL_SIMD_X86
+    static bool const avx2 = __builtin_cpu_supports( "avx2" );
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+void add_bit_counts( std::uint32_t const *src, std::size_t const n, std::uint8_t const bits, std::uint64_t *count ) noexcept
+{
+#ifdef FLACUTIL_SIMD_X86
+    if( has_avx2() )
+        return add_bit_counts_avx2( src, n, bits, count );
+#endif
+    add_bit_counts_generic( src, n, bits, count );
+}
+
+template< typename T >
+static
+void fixed_residuals_impl( T const *src, std::size_t const n, bool const narrow, std::int64_t *const *residual ) noexcept
+{
+    for( std::size_t i = 0; i < n && i < 4; ++i )
+        fixed_residuals_head( src, i, residual );
+    if( n <= 4 )
+        return;
+    std::size_t i = 4;
+#ifdef FLACUTIL_SIMD_X86
+    if( has_avx2() )
+        i = narrow ? fixed_residuals_narrow_avx2( src, n, residual ) : fixed_residuals_avx2( src, n, residual );
+#else
+    static_cast< void >( narrow );
+#endif
+    fixed_residuals_generic( src, i, n, residual );
+}
+void fixed_residuals( std::int16_t const *src, std::size_t const n, bool const narrow, std::int64_t *const *residual ) noexcept
+{
+    fixed_residuals_impl( src, n, narrow, residual );
+}
+void fixed_residuals( std::int32_t const *src, std::size_t const n, bool const narrow, std::int64_t *const *residual ) noexcept
+{
+    fixed_residuals_impl( src, n, narrow, residual );
+}
+void fixed_residuals( std::int64_t const *src, std::size_t const n, bool const narrow, std::int64_t *const *residual ) noexcept
+{
+    fixed_residuals_impl( src, n, narrow, residual );
+}
+
+void md5_blocks( std::uint32_t (*state)[ 4 ], std::uint8_t const *const *data, std::size_t const blocks, std::size_t const lanes ) noexcept
+{
+    std::size_t l = 0;
+#ifdef FLACUTIL_SIMD_X86
+    // a single stream gains nothing from the lanes
+    if( has_avx2() )
+        for( ; l + 1 < lanes; l += 8 )
+            md5_blocks_avx2( state + l, data + l, blocks, std::min< std::size_t >( 8, lanes - l ) );
+#endif
+    for( ; l < lanes; ++l )
+        md5_blocks_generic( state[ l ], data[ l ], blocks );
+}
+
+} // namespace simd
@@ -0,0 +1,29 @@
+#ifndef FLACUTIL_SIMD_HPP
+#define FLACUTIL_SIMD_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernels with a vectorized implementation chosen at runtime and a portable fallback.
+// Every implementation gives the same result.
+namespace simd{
+
+// whether the AVX2 implementations are used
+bool has_avx2() noexcept;
+
+// count[ b ] += the number of values in src[ 0 .. n - 1 ] whose bit b is set, for b < bits (<= 32)
+void add_bit_counts( std::uint32_t const *src, std::size_t n, std::uint8_t bits, std::uint64_t *count ) noexcept;
+
+// residual[ k ][ i - k ] = the order k fixed predictor residual of src[ i ], for 0 <= k <= 4 and k <= i < n.
+// narrow: every residual fits in 32 bits, so 32 bit lanes may be used
+void fixed_residuals( std::int16_t const *src, std::size_t n, bool narrow, std::int64_t *const *residual ) noexcept;
+void fixed_residuals( std::int32_t const *src, std::size_t n, bool narrow, std::int64_t *const *residual ) noexcept;
+void fixed_residuals( std::int64_t const *src, std::size_t n, bool narrow, std::int64_t *const *residual ) noexcept;
+
+// the MD5 compression of lanes independent streams: state[ l ] is updated with the blocks
+// data[ l ][ 0 .. 64 * blocks - 1 ]; up to 8 lanes are processed side by side
+void md5_blocks( std::uint32_t (*state)[ 4 ], std::uint8_t const *const *data, std::size_t blocks, std::size_t lanes ) noexcept;
+
+} // namespace simd
+
+#endif // FLACUTIL_SIMD_HPP
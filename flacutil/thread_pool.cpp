@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "thread_pool.hpp"
+
+namespace thread_pool
+{
+
+namespace detail
+{
+
+void task_deque::push( std::unique_ptr< task > t )
+{
+    std::lock_guard< std::mutex > lg( mutex );
+    tasks.emplace_back( std::move( t ) );
+}
+std::unique_ptr< task > task_deque::pop()
+{
+    std::lock_guard< std::mutex > lg( mutex );
+    if( tasks.empty() )
+        return nullptr;
+    auto t = std::move( tasks.back() );
+    tasks.pop_back();
+    return t;
+}
+std::unique_ptr< task > task_deque::steal()
+{
+    std::lock_guard< std::mutex > lg( mutex );
+    if( tasks.empty() )
+        return nullptr;
+    auto t = std::move( tasks.front() );
+    tasks.pop_front();
+    return t;
+}
+
+} // namespace detail
+
+// the pool and the deque index of the calling thread, if it is a worker
+static thread_local pool        *current_pool  = nullptr;
+static thread_local std::size_t  current_index = 0;
+
+pool::pool( unsigned int const num )
+    : queued( 0 )
+    , stop( false )
+{
+    unsigned int const n = num != 0 ? num : std::max( 1u, std::thread::hardware_concurrency() );
+    for( unsigned int i = 0; i < n; ++i )
+        queues.emplace_back( std::make_unique< detail::task_deque >() );
+    for( unsigned int i = 0; i < n; ++i )
+        threads.emplace_back( [ this, i ]{ worker( i ); } );
+}
+pool::~pool()
+{
+    {
+        std::lock_guard< std::mutex > lg( sleep_mutex );
+        stop = true;
+    }
+    sleep_cond.notify_all();
+    for( auto &&th : threads )
+        th.join();
+}
+void pool::push( std::unique_ptr< detail::task > t )
+{
+    if( current_pool == this )
+        queues[ current_index ]->push( std::move( t ) );
+    else
+        injected.push( std::move( t ) );
+    ++queued;
+    {
+        std::lock_guard< std::mutex > lg( sleep_mutex );
+    }
+    sleep_cond.notify_one();
+}
+std::unique_ptr< detail::task > pool::take_forked( std::size_t const index )
+{
+    if( auto t = queues[ index ]->pop() )
+        return t;
+    for( std::size_t i = 1; i < queues.size(); ++i )
+        if( auto t = queues[ (index + i) % queues.size() ]->steal() )
+            return t;
+    return nullptr;
+}
+std::unique_ptr< detail::task > pool::take( std::size_t const index )
+{
+    if( auto t = take_forked( index ) )
+        return t;
+    return injected.steal();
+}
+bool pool::run_forked()
+{
+    auto t = take_forked( current_pool == this ? current_index : 0 );
+    if( !t )
+        return false;
+    --queued;
+    t->run();
+    return true;
+}
+pool *pool::current() noexcept
+{
+    return current_pool;
+}
+void pool::worker( std::size_t const index )
+{
+    current_pool = this;
+    current_index = index;
+    while( true )
+    {
+        if( auto t = take( index ) )
+        {
+            --queued;
+            t->run();
+            continue;
+        }
+        std::unique_lock< std::mutex > ul( sleep_mutex );
+        sleep_cond.wait( ul, [ & ]{ return stop || queued.load() != 0; } );
+        if( stop && queued.load() == 0 )
+            return;
+    }
+}
+
+} // namespace thread_pool
@@ -0,0 +1,118 @@
+#ifndef FLACUTIL_THREAD_POOL_HPP
+#define FLACUTIL_THREAD_POOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace thread_pool
+{
+
+namespace detail
+{
+    class task
+    {
+    public:
+        virtual ~task() = default;
+        virtual void run() = 0;
+    };
+    template< typename Func >
+    class task_impl : public task
+    {
+    private:
+        Func func;
+
+    public:
+        task_impl( Func &&func )
+            : func( std::move( func ) )
+        {
+        }
+        virtual void run()
+        {
+            func();
+        }
+    };
+
+    // owner pushes and pops at the back, thieves take from the front
+    class task_deque
+    {
+    private:
+        std::mutex                                mutex;
+        std::deque< std::unique_ptr< task > > tasks;
+
+    public:
+        void push( std::unique_ptr< task > t );
+        std::unique_ptr< task > pop();
+        std::unique_ptr< task > steal();
+    };
+} // namespace detail
+
+// Work-stealing thread pool.
+// Every worker has its own deque. Tasks submitted from a worker go to its own deque, and an
+// idle worker steals the oldest task of the others. Tasks submitted from outside go to a
+// shared queue, which is taken from in order once the deques are empty.
+class pool
+{
+private:
+    std::vector< std::unique_ptr< detail::task_deque > > queues;
+    detail::task_deque                                   injected; // submitted from outside
+    std::vector< std::thread >                           threads;
+    std::atomic< std::size_t >                           queued;
+    std::mutex                                           sleep_mutex;
+    std::condition_variable                              sleep_cond;
+    bool                                                 stop;
+
+    void push( std::unique_ptr< detail::task > t );
+    std::unique_ptr< detail::task > take_forked( std::size_t const index );
+    std::unique_ptr< detail::task > take( std::size_t const index );
+    bool run_forked();
+    void worker( std::size_t const index );
+
+public:
+    // threads == 0: std::thread::hardware_concurrency()
+    explicit pool( unsigned int threads = 0 );
+    pool( pool const & ) = delete;
+    pool &operator=( pool const & ) = delete;
+    ~pool();
+
+    unsigned int size() const noexcept
+    {
+        return threads.size();
+    }
+    // the pool the calling thread works for, nullptr outside of the workers
+    static pool *current() noexcept;
+    template< typename Func >
+    std::future< std::result_of_t< Func() > > submit( Func &&func )
+    {
+        std::packaged_task< std::result_of_t< Func() >() > pt( std::forward< Func >( func ) );
+        auto fu = pt.get_future();
+        push( std::make_unique< detail::task_impl< decltype( pt ) > >( std::move( pt ) ) );
+        return fu;
+    }
+    // Wait until fu is ready, running tasks forked by the workers meanwhile, so that a task
+    // can wait for the tasks it submitted without taking a worker away from the pool.
+    // The tasks submitted from outside are left alone: one of them would keep the waiting
+    // task from finishing for as long as it runs, and could wait again itself.
+    // With nothing to run, it blocks on fu for a moment instead of spinning, so that the
+    // worker does not take the CPU from the one running the task it waits for.
+    template< typename T >
+    void wait( std::future< T > const &fu )
+    {
+        while( fu.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready )
+            if( !run_forked() )
+                fu.wait_for( std::chrono::microseconds( 200 ) );
+    }
+};
+
+} // namespace thread_pool
+
+#endif // FLACUTIL_THREAD_POOL_HPP
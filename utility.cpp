@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <tuple>
 #include <vector>
 #include <fstream>
 
+#include <dirent.h>
+#include <sys/stat.h>
+
 #include "utility.hpp"
 
 std::tuple< std::unique_ptr< std::uint8_t[] >, std::size_t > read_file( char const *filename ) noexcept
@@ -23,3 +28,26 @@ catch( ... )
 {
     return std::make_tuple( nullptr, 0 );
 }
+bool is_directory( char const *path ) noexcept
+{
+    struct stat st;
+    return ::stat( path, &st ) == 0 && S_ISDIR( st.st_mode );
+}
+std::vector< std::string > list_directory( std::string const &dirname )
+{
+    std::vector< std::string > paths;
+    DIR *const dir = ::opendir( dirname.c_str() );
+    if( dir == nullptr )
+        return paths;
+    std::string const prefix = dirname.empty() || dirname.back() == '/' ? dirname : dirname + '/';
+    while( dirent const *const entry = ::readdir( dir ) )
+    {
+        std::string const path = prefix + entry->d_name;
+        struct stat st;
+        if( ::stat( path.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) )
+            paths.push_back( path );
+    }
+    ::closedir( dir );
+    std::sort( paths.begin(), paths.end() );
+    return paths;
+}
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -35,5 +36,8 @@ bool fatal( Args &&... args )
 }
 
 std::tuple< std::unique_ptr< std::uint8_t[] >, std::size_t > read_file( char const *filename ) noexcept;
+bool is_directory( char const *path ) noexcept;
+// the paths of the regular files in a directory, sorted by name; empty if it cannot be read
+std::vector< std::string > list_directory( std::string const &dirname );
 
 #endif // UTILITY_HPP